@@ -328,13 +328,14 @@ struct ChessView : public View {
   }
 
   void DrawGame(Window *W, const point &p, Chess::Game *game, Time now) {
-    int black_font_index[7] = { 0, 3, 2, 0, 5, 4, 1 }, bits[65];
+    int black_font_index[7] = { 0, 3, 2, 0, 5, 4, 1 };
     static Font *pieces = app->fonts->Get(W->gl_h, "ChessPieces1");
     Drawable::Attr draw_attr(pieces);
     GraphicsContext gc(W->gd);
-    for (int i=Chess::PAWN; i <= Chess::KING; i++) {
-      Bit::Indices(game->position.white[i], bits); for (int *b = bits; *b != -1; b++) pieces->DrawGlyph(W->gd, black_font_index[i]+6, SquareCoords(*b, game->flip_board)+p);
-      Bit::Indices(game->position.black[i], bits); for (int *b = bits; *b != -1; b++) pieces->DrawGlyph(W->gd, black_font_index[i],   SquareCoords(*b, game->flip_board)+p);
+    for (int s=0; s<64; s++) {
+      Chess::Piece piece = game->position.board[s];
+      if (int i = Chess::GetPieceType(piece))
+        pieces->DrawGlyph(W->gd, black_font_index[i] + (Chess::GetPieceColor(piece) ? 0 : 6), SquareCoords(s, game->flip_board)+p);
     }
 
     if (game->position.move_number) {
@@ -38,14 +38,10 @@ enum { h1=0,  g1=1,  f1=2,  e1=3,  d1=4,  c1=5,  b1=6,  a1=7,
        h8=56, g8=57, f8=58, e8=59, d8=60, c8=61, b8=62, a8=63 };
 struct MoveFlag { enum { Killer=1<<28, Check=1<<27, Castle=1<<26, DoubleStepPawn=1<<7, EnPassant=1<<6 }; };
 
-static int no_special_moves[] = { 0 };
-static int king_special_moves [] = { MoveFlag::Castle, 0 };
-static int pawn_special_moves [] = { MoveFlag::DoubleStepPawn, MoveFlag::EnPassant, 0 };
-static int *special_moves[] = { nullptr, pawn_special_moves, no_special_moves, no_special_moves, no_special_moves, no_special_moves, king_special_moves };
-
 //                                      { 0, pawns,         knights,     bishops,     rooks,       queen,       king       };
-static const BitBoard white_initial[] = { 0, 0xff00ULL,     0x42ULL,     0x24ULL,     0x81ULL,     0x10ULL,     0x8ULL     };
-static const BitBoard black_initial[] = { 0, 0xff00ULL<<40, 0x42ULL<<56, 0x24ULL<<56, 0x81ULL<<56, 0x10ULL<<56, 0x8ULL<<56 };
+static constexpr BitBoard white_initial[] = { 0, 0xff00ULL,     0x42ULL,     0x24ULL,     0x81ULL,     0x10ULL,     0x8ULL     };
+static constexpr BitBoard black_initial[] = { 0, 0xff00ULL<<40, 0x42ULL<<56, 0x24ULL<<56, 0x81ULL<<56, 0x10ULL<<56, 0x8ULL<<56 };
+static constexpr BitBoard file_a_mask = 0x8080808080808080ULL, file_h_mask = 0x0101010101010101ULL;
 static const BitBoard black_castle_path = 0x600000000000000LL, black_castle_long_clear = 0x7000000000000000LL, black_castle_long_path = 0x3000000000000000LL;
 static const BitBoard white_castle_path = 0x6LL,               white_castle_long_clear = 0x70LL,               white_castle_long_path = 0x30LL;
 
@@ -125,10 +121,25 @@ inline Piece GetPiece(bool color, uint8_t piece) {
   return (uint8_t(color) << 3) | (piece & 7);
 }
 
-inline int8_t SquareX(int s) { return 7 - (s % 8); }
-inline int8_t SquareY(int s) { return s / 8; }
-inline int8_t SquareFromXY(int x, int y) { return (x<0 || y<0 || x>7 || y>7) ? -1 : (y*8 + (7-x)); }
-inline BitBoard SquareMask(int s) { return 1LL << s; }
+constexpr int8_t SquareX(int s) { return 7 - (s % 8); }
+constexpr int8_t SquareY(int s) { return s / 8; }
+constexpr int8_t SquareFromXY(int x, int y) { return (x<0 || y<0 || x>7 || y>7) ? -1 : (y*8 + (7-x)); }
+constexpr BitBoard SquareMask(int s) { return 1ULL << s; }
+template <int N> constexpr BitBoard ShiftBoard(BitBoard b) { return N > 0 ? (b << (N > 0 ? N : 0)) : (b >> (N < 0 ? -N : 0)); }
+constexpr BitBoard PawnSetAttacks(BitBoard pawns, bool black) {
+  return black ? (ShiftBoard<-9>(pawns & ~file_h_mask) | ShiftBoard<-7>(pawns & ~file_a_mask)) :
+                 (ShiftBoard< 9>(pawns & ~file_a_mask) | ShiftBoard< 7>(pawns & ~file_h_mask));
+}
+constexpr BitBoard KnightSetAttacks(BitBoard knights) {
+  const BitBoard a1 = knights & ~file_a_mask, a2 = a1 & ~(file_a_mask >> 1);
+  const BitBoard h1 = knights & ~file_h_mask, h2 = h1 & ~(file_h_mask << 1);
+  return ShiftBoard<17>(a1) | ShiftBoard<15>(h1) | ShiftBoard<10>(a2) | ShiftBoard<6>(h2) |
+    ShiftBoard<-15>(a1) | ShiftBoard<-17>(h1) | ShiftBoard<-6>(a2) | ShiftBoard<-10>(h2);
+}
+constexpr BitBoard KingSetAttacks(BitBoard kings) {
+  const BitBoard rank = kings | ShiftBoard<1>(kings & ~file_a_mask) | ShiftBoard<-1>(kings & ~file_h_mask);
+  return (rank | ShiftBoard<8>(rank) | ShiftBoard<-8>(rank)) & ~kings;
+}
 inline int8_t SquareID(const char *s) {
   if (s[0] < 'a' || s[0] > 'h' || s[1] < '1' || s[1] > '8') return ERRORv(-1, "unknown square: ", s);
   return 8 * (s[1] - '1') + 7 - (s[0] - 'a');
@@ -200,6 +211,43 @@ BitBoard ByteBoardToBitBoard(const ByteBoard &buf, char piece) {
   return ret;
 }
 
+struct SquareLines {
+  BitBoard between[64][64] = {}, line[64][64] = {};
+  constexpr SquareLines() {
+    const int dx[] = { 1, 1, 0, -1 }, dy[] = { 0, 1, 1, 1 };
+    for (int s=0; s<64; s++)
+      for (int d=0; d<4; d++) {
+        BitBoard full = SquareMask(s);
+        for (int dir=-1; dir<=1; dir+=2)
+          for (int x=SquareX(s)+dir*dx[d], y=SquareY(s)+dir*dy[d]; SquareFromXY(x, y) >= 0; x+=dir*dx[d], y+=dir*dy[d])
+            full |= SquareMask(SquareFromXY(x, y));
+        for (int dir=-1; dir<=1; dir+=2) {
+          BitBoard ray = 0;
+          for (int x=SquareX(s)+dir*dx[d], y=SquareY(s)+dir*dy[d], t=0; (t = SquareFromXY(x, y)) >= 0; x+=dir*dx[d], y+=dir*dy[d]) {
+            between[s][t] = ray;
+            line[s][t] = full;
+            ray |= SquareMask(t);
+          }
+        }
+      }
+  }
+};
+
+static constexpr SquareLines square_lines;
+
+inline BitBoard BetweenMask(int a, int b) { return square_lines.between[a][b]; }
+inline BitBoard LineMask   (int a, int b) { return square_lines.line[a][b]; }
+
+inline bool CastleRookSquares(int8_t king_to, uint8_t *rook_from, uint8_t *rook_to) {
+  switch(king_to) {
+    case g1: *rook_from = h1; *rook_to = f1; return true;
+    case g8: *rook_from = h8; *rook_to = f8; return true;
+    case c1: *rook_from = a1; *rook_to = d1; return true;
+    case c8: *rook_from = a8; *rook_to = d8; return true;
+    default:                                 return false;
+  }
+}
+
 }; // namespace Chess
 }; // namespace LFL
 #include "magic.h"
@@ -213,6 +261,10 @@ inline uint8_t GetMoveToSquare  (Move move) { return (move >> 8) & 0x3f; }
 inline uint8_t GetMoveCapture   (Move move) { return (move >> 23) & 0x7; }
 inline uint8_t GetMovePromotion (Move move) { return (move >> 29) & 0x7; }
 inline string GetLongMoveName(Move move) { return StrCat(SquareName(GetMoveFromSquare(move)), SquareName(GetMoveToSquare(move))); }
+inline string GetUCIMoveName(Move move) {
+  uint8_t promotion = GetMovePromotion(move);
+  return promotion ? StrCat(GetLongMoveName(move), string(1, ByteBoardPieceSymbol(promotion, BLACK))) : GetLongMoveName(move);
+}
 inline Move GetMoveFlagMask() { return (0x7 << 26) | 0xff; }
 
 inline Move GetMove(uint8_t piece, uint8_t start_square, uint8_t end_square, uint8_t capture, uint8_t promote, uint32_t flags) {
@@ -227,6 +279,14 @@ struct PieceCount {
                                              int(bishop_count), ", ", int(rook_count), ", ",
                                              int(queen_count), ", ", int(king_count), "}"); }
   void Clear() { pawn_count=knight_count=bishop_count=rook_count=queen_count=king_count=0; }
+  void Count(const BitBoard *pieces) {
+    pawn_count   = Bit::Count(pieces[PAWN]);
+    knight_count = Bit::Count(pieces[KNIGHT]);
+    bishop_count = Bit::Count(pieces[BISHOP]);
+    rook_count   = Bit::Count(pieces[ROOK]);
+    queen_count  = Bit::Count(pieces[QUEEN]);
+    king_count   = Bit::Count(pieces[KING]);
+  }
   void Add(uint8_t piece) {
     switch(piece) {
       case PAWN:   ++pawn_count;   break;
@@ -238,6 +298,17 @@ struct PieceCount {
       default:     FATAL("unknown piece ", int(piece));
     }
   }            
+  uint8_t Get(uint8_t piece) const {
+    switch(piece) {
+      case PAWN:   return pawn_count;
+      case KNIGHT: return knight_count;
+      case BISHOP: return bishop_count;
+      case ROOK:   return rook_count;
+      case QUEEN:  return queen_count;
+      case KING:   return king_count;
+      default:     FATAL("unknown piece ", int(piece));
+    }
+  }
 };
 
 struct PositionFlags {
@@ -253,10 +324,14 @@ struct PositionFlags {
 
 struct BitBoardPosition {
   BitBoard white[7], black[7];
+  Piece board[64];
+  mutable BitBoard attack_cache[2] = { 0, 0 };
+  mutable uint8_t attack_cache_valid=0;
   BitBoardPosition() {}
 
   BitBoard AllPieces() const { return white[ALL] | black[ALL]; }
   const BitBoard *Pieces(bool color) const { return color ? black : white; }
+  template <int Us> const BitBoard *Pieces() const { return Us == BLACK ? black : white; }
   /**/  BitBoard *Pieces(bool color)       { return color ? black : white; }
 
   void SetInitialPosition() {
@@ -264,6 +339,7 @@ struct BitBoardPosition {
     for (int i=PAWN; i!=END_PIECES; ++i) black[i] = black_initial[i];
     SetAll(WHITE);
     SetAll(BLACK);
+    UpdateBoard();
   }
 
   void LoadByteBoard(const string &b) {
@@ -271,34 +347,46 @@ struct BitBoardPosition {
     for (int i=PAWN; i!=END_PIECES; ++i) black[i] = ByteBoardToBitBoard(b, ByteBoardPieceSymbol(i, BLACK));
     SetAll(WHITE);
     SetAll(BLACK);
+    UpdateBoard();
+  }
+
+  void UpdateBoard() {
+    for (int s=0; s<64; s++) board[s] = ScanSquare(s);
   }
 
   string GetByteBoard() const {
     string ret = EmptyByteBoard();
-    for (int8_t color=0; color<2; color++)
-      for (int8_t piece_type = PAWN; piece_type != END_PIECES; ++piece_type)
-        for (SquareIter p(Pieces(color)[piece_type]); p; ++p) {
-          int8_t s = p.GetSquare();
-          ret[(7-SquareY(s))*9 + SquareX(s)] =
-            color ? PieceChar(piece_type) : std::toupper(PieceChar(piece_type));
-        }
+    for (int8_t s=0; s<64; s++)
+      if (uint8_t piece_type = GetPieceType(board[s]))
+        ret[(7-SquareY(s))*9 + SquareX(s)] = ByteBoardPieceSymbol(piece_type, GetPieceColor(board[s]));
     return ret;
   }
 
   void SetAll(bool color) {
     BitBoard *pieces = Pieces(color);
     pieces[ALL] = pieces[PAWN] | pieces[KNIGHT] | pieces[BISHOP] | pieces[ROOK] | pieces[QUEEN] | pieces[KING];
+    attack_cache_valid = 0;
   }
 
   void SetSquare(int s, Piece piece) {
     BitBoard mask = SquareMask(s);
+    attack_cache_valid = 0;
     uint8_t piece_color = GetPieceColor(piece), piece_type = GetPieceType(piece);
     DEBUG_CHECK_RANGE(piece_type, PAWN, END_PIECES);
+    board[s] = piece;
     if (piece_color) { black[piece_type] |= mask; black[0] |= mask; }
     else             { white[piece_type] |= mask; white[0] |= mask; }
   }
 
   Piece GetSquare(int s, bool get_white=true, bool get_black=true, bool maybe_empty=true) const {
+    Piece piece = board[s];
+    if (GetPieceType(piece) && (GetPieceColor(piece) ? get_black : get_white)) return piece;
+    BitBoard mask = SquareMask(s);
+    if ((get_white && (white[0] & mask)) || (get_black && (black[0] & mask))) return ScanSquare(s, get_white, get_black, maybe_empty);
+    return GetPiece(WHITE, 0);
+  }
+
+  Piece ScanSquare(int s, bool get_white=true, bool get_black=true, bool maybe_empty=true) const {
     BitBoard mask = SquareMask(s);
     if (get_white) { if (!maybe_empty || (mask & white[0])) for (int i=PAWN; i!=END_PIECES; ++i) if (white[i] & mask) return GetPiece(WHITE, i); }
     if (get_black) { if (!maybe_empty || (mask & black[0])) for (int i=PAWN; i!=END_PIECES; ++i) if (black[i] & mask) return GetPiece(BLACK, i); }
@@ -306,36 +394,60 @@ struct BitBoardPosition {
   }
 
   Piece ClearSquare(int s, bool clear_white=true, bool clear_black=true, bool maybe_empty=true) {
-    BitBoard mask = SquareMask(s);
-    if (clear_white) { if (!maybe_empty || (mask & white[0])) for (int i=PAWN; i!=END_PIECES; ++i) if (white[i] & mask) { white[0] &= ~mask; white[i] &= ~mask; return GetPiece(WHITE, i); } }
-    if (clear_black) { if (!maybe_empty || (mask & black[0])) for (int i=PAWN; i!=END_PIECES; ++i) if (black[i] & mask) { black[0] &= ~mask; black[i] &= ~mask; return GetPiece(BLACK, i); } }
-    return GetPiece(WHITE, 0);
+    Piece piece = board[s];
+    if (GetPieceType(piece) && (GetPieceColor(piece) ? clear_black : clear_white))
+      return ClearSquareOfKnownPiece(s, GetPieceType(piece), GetPieceColor(piece));
+    if (!(piece = ScanSquare(s, clear_white, clear_black, maybe_empty))) return piece;
+    return ClearSquareOfKnownPiece(s, GetPieceType(piece), GetPieceColor(piece));
   }
 
   Piece ClearSquareOfKnownPiece(int s, int t, bool color) {
-    BitBoard mask = SquareMask(s);
-    if (color) { black[0] &= ~mask; black[t] &= ~mask; return GetPiece(BLACK, t); }
-    else       { white[0] &= ~mask; white[t] &= ~mask; return GetPiece(WHITE, t); }
-    return GetPiece(WHITE, 0);
+    return color ? ClearSquareOfKnownPiece<BLACK>(s, t) : ClearSquareOfKnownPiece<WHITE>(s, t);
+  }
+
+  template <int Us> Piece ClearSquareOfKnownPiece(int s, int t) {
+    BitBoard mask = SquareMask(s), *pieces = Us == BLACK ? black : white;
+    attack_cache_valid = 0;
+    pieces[0] &= ~mask;
+    pieces[t] &= ~mask;
+    if (board[s] == GetPiece(Us, t)) board[s] = ((white[0] | black[0]) & mask) ? ScanSquare(s) : 0;
+    return GetPiece(Us, t);
   }
 
-  BitBoard PawnAttacks(int p, bool black) const {
-    return black ? black_pawn_attack_mask[p] : white_pawn_attack_mask[p];
+  template <int Us> void SetSquareOfKnownPiece(int s, int t) {
+    BitBoard mask = SquareMask(s), *pieces = Us == BLACK ? black : white;
+    attack_cache_valid = 0;
+    board[s] = GetPiece(Us, t);
+    pieces[t] |= mask;
+    pieces[0] |= mask;
   }
 
-  BitBoard PawnCaptures(int p, bool black) const {
-    return black ? (black_pawn_attack_mask[p] & Pieces(!black)[ALL])
-                 : (white_pawn_attack_mask[p] & Pieces(!black)[ALL]);
+  BitBoard PawnAttacks(int p, bool black) const { return black ? PawnAttacks<BLACK>(p) : PawnAttacks<WHITE>(p); }
+  template <int Us> BitBoard PawnAttacks(int p) const {
+    return Us == BLACK ? black_pawn_attack_mask[p] : white_pawn_attack_mask[p];
+  }
+
+  BitBoard PawnCaptures(int p, bool black) const { return black ? PawnCaptures<BLACK>(p) : PawnCaptures<WHITE>(p); }
+  template <int Us> BitBoard PawnCaptures(int p) const {
+    return PawnAttacks<Us>(p) & Pieces<!Us>()[ALL];
   }
 
   BitBoard SingleStepPawnAdvances(int p, bool black) const {
-    return (black ? (SquareMask(p) >> 8) : (SquareMask(p) << 8)) & ~AllPieces();
+    return black ? SingleStepPawnAdvances<BLACK>(p) : SingleStepPawnAdvances<WHITE>(p);
+  }
+
+  template <int Us> BitBoard SingleStepPawnAdvances(int p) const {
+    return (Us == BLACK ? (SquareMask(p) >> 8) : (SquareMask(p) << 8)) & ~AllPieces();
   }
 
   BitBoard DoubleStepPawnAdvances(int p, bool black) const {
-    if (black) { if (SquareY(p) == 6) if ((black_pawn_occupancy_mask[p] & AllPieces()) == 0) return SquareMask(p-16); }
-    else       { if (SquareY(p) == 1) if ((white_pawn_occupancy_mask[p] & AllPieces()) == 0) return SquareMask(p+16); }
-    return 0;
+    return black ? DoubleStepPawnAdvances<BLACK>(p) : DoubleStepPawnAdvances<WHITE>(p);
+  }
+
+  template <int Us> BitBoard DoubleStepPawnAdvances(int p) const {
+    const BitBoard *occupancy_mask = Us == BLACK ? black_pawn_occupancy_mask : white_pawn_occupancy_mask;
+    if (SquareY(p) != (Us == BLACK ? 6 : 1) || (occupancy_mask[p] & AllPieces())) return 0;
+    return SquareMask(Us == BLACK ? p-16 : p+16);
   }
 
   BitBoard PawnAdvances(int p, bool black) const {
@@ -347,18 +459,16 @@ struct BitBoardPosition {
   }
 
   BitBoard BishopMoves(int p, bool black) const {
-    static MagicMoves *magic_moves = Singleton<MagicMoves>::Set();
-    BitBoard blockers = AllPieces() & bishop_occupancy_mask[p];
-    return magic_moves->BishopMoves(p, blockers, Pieces(black)[ALL]);
+    return slider_moves.BishopAttacks(p, AllPieces()) & ~Pieces(black)[ALL];
   }
 
   BitBoard RookMoves(int p, bool black) const {
-    static MagicMoves *magic_moves = Singleton<MagicMoves>::Set();
-    BitBoard blockers = AllPieces() & rook_occupancy_mask[p];
-    int magic_index = MagicMoves::MagicHash(p, blockers, rook_magic_number, rook_magic_number_bits);
-    return magic_moves->rook_magic_moves[p][magic_index] & ~Pieces(black)[ALL];
+    return slider_moves.RookAttacks(p, AllPieces()) & ~Pieces(black)[ALL];
   }
 
+  static BitBoard BishopAttacks(int p, BitBoard occupied) { return slider_moves.BishopAttacks(p, occupied); }
+  static BitBoard RookAttacks  (int p, BitBoard occupied) { return slider_moves.RookAttacks  (p, occupied); }
+
   BitBoard QueenMoves(int p, bool black) const {
     return RookMoves(p, black) | BishopMoves(p, black);
   }
@@ -371,15 +481,38 @@ struct BitBoardPosition {
 
   BitBoard PieceAttacks(int piece, int square, bool black) const {
     if      (piece == PAWN)   return PawnAttacks(square, black);
-    else if (piece == KNIGHT) return KnightMoves(square, black);
-    else if (piece == BISHOP) return BishopMoves(square, black);
-    else if (piece == ROOK)   return RookMoves  (square, black);
-    else if (piece == QUEEN)  return QueenMoves (square, black);
+    else if (piece == KNIGHT) return knight_occupancy_mask[square];
+    else if (piece == BISHOP) return BishopAttacks(square, AllPieces());
+    else if (piece == ROOK)   return RookAttacks  (square, AllPieces());
+    else if (piece == QUEEN)  return RookAttacks  (square, AllPieces()) | BishopAttacks(square, AllPieces());
     else if (piece == KING)   return KingAttacks(square, black);
     else                      FATAL("unknown piece ", piece);
   }
 
   BitBoard AllAttacks(bool color) const {
+    if (!(attack_cache_valid & (1 << color))) {
+      attack_cache[color] = ComputeAllAttacks(color);
+      attack_cache_valid |= (1 << color);
+    }
+    return attack_cache[color];
+  }
+
+  BitBoard ComputeAllAttacks(bool color) const {
+#ifdef CHESS_AVX2_ATTACKS
+    if (cpu_has_avx2) return ComputeAllAttacksAVX2(color);
+#endif
+    return ComputeAllAttacksScalar(color);
+  }
+
+#ifdef CHESS_AVX2_ATTACKS
+  BitBoard ComputeAllAttacksAVX2(bool color) const {
+    const BitBoard *pieces = Pieces(color);
+    return PawnSetAttacks(pieces[PAWN], color) | KnightSetAttacks(pieces[KNIGHT]) | KingSetAttacks(pieces[KING]) |
+      KoggeStoneAttacks::SliderAttacks(pieces[ROOK] | pieces[QUEEN], pieces[BISHOP] | pieces[QUEEN], AllPieces());
+  }
+#endif
+
+  BitBoard ComputeAllAttacksScalar(bool color) const {
     BitBoard ret = 0;
     for (int piece_type = PAWN; piece_type != END_PIECES; ++piece_type)
       for (SquareIter p(Pieces(color)[piece_type]); p; ++p)
@@ -390,6 +523,38 @@ struct BitBoardPosition {
   bool InCheck(bool color, BitBoard attacks) const {
     return attacks & Pieces(color)[KING];
   }
+
+  BitBoard AttackersTo(int s, BitBoard occupied) const {
+    return (black_pawn_attack_mask[s] & white[PAWN]) | (white_pawn_attack_mask[s] & black[PAWN]) |
+      (knight_occupancy_mask[s] & (white[KNIGHT] | black[KNIGHT])) |
+      (king_occupancy_mask[s]   & (white[KING]   | black[KING])) |
+      (RookAttacks  (s, occupied) & (white[ROOK]   | black[ROOK]   | white[QUEEN] | black[QUEEN])) |
+      (BishopAttacks(s, occupied) & (white[BISHOP] | black[BISHOP] | white[QUEEN] | black[QUEEN]));
+  }
+
+  BitBoard Checkers(bool color) const { return color ? Checkers<BLACK>() : Checkers<WHITE>(); }
+  template <int Us> BitBoard Checkers() const {
+    BitBoard king = Pieces<Us>()[KING];
+    return king ? (AttackersTo(ffsll(king) - 1, AllPieces()) & Pieces<!Us>()[ALL]) : 0;
+  }
+
+  BitBoard PinnedPieces(bool color) const { return color ? PinnedPieces<BLACK>() : PinnedPieces<WHITE>(); }
+  template <int Us> BitBoard PinnedPieces() const {
+    const BitBoard *enemy = Pieces<!Us>();
+    BitBoard king = Pieces<Us>()[KING];
+    return king ? SliderBlockers(ffsll(king) - 1, enemy[ROOK] | enemy[QUEEN], enemy[BISHOP] | enemy[QUEEN], Pieces<Us>()[ALL]) : 0;
+  }
+
+  // The pieces in mask that are the only piece between king_square and a rook or bishop slider.
+  BitBoard SliderBlockers(int king_square, BitBoard rooks, BitBoard bishops, BitBoard mask) const {
+    BitBoard occupied = AllPieces(), ret = 0;
+    BitBoard snipers = (RookAttacks(king_square, 0) & rooks) | (BishopAttacks(king_square, 0) & bishops);
+    for (SquareIter s(snipers); s; ++s) {
+      BitBoard blockers = BetweenMask(king_square, s.GetSquare()) & occupied;
+      if (blockers && !(blockers & (blockers - 1))) ret |= blockers & mask;
+    }
+    return ret;
+  }
 };
 
 struct ZobristHasher {
@@ -397,18 +562,29 @@ struct ZobristHasher {
   enum { BlackToMove=0, WhiteCanCastleShort=1, WhiteCanCastleLong=2,
     BlackCanCastleShort=3, BlackCanCastleLong=4, DoubleStepPawnA=5, End=13 };
 
-  vector<Hash> data;
-  Hash initial_position_hash;
-  ZobristHasher() : data(12*64 + End) {
-    for (auto &v : data) v = Rand<Hash>(); 
-    BitBoardPosition ip;
-    ip.SetInitialPosition();
-    PositionFlags flags;
-    memzero(flags);
-    initial_position_hash = GetHash(ip, flags, 0);
+  Hash data[12*64 + End] = {};
+  Hash initial_position_hash = 0, initial_pawn_hash = 0, initial_material_hash = 0;
+  constexpr ZobristHasher() {
+    Hash state = 0;
+    for (auto &v : data) v = SplitMix64(&state);
+    for (uint8_t piece_type = PAWN; piece_type != END_PIECES; ++piece_type)
+      for (uint8_t s = 0, white_count = 0, black_count = 0; s != 64; ++s) {
+        if (white_initial[piece_type] & SquareMask(s)) {
+          initial_position_hash ^= data[PieceSquareIndex(WHITE, piece_type, s)];
+          initial_material_hash ^= data[MaterialIndex(WHITE, piece_type, white_count++)];
+          if (piece_type == PAWN) initial_pawn_hash ^= data[PieceSquareIndex(WHITE, piece_type, s)];
+        }
+        if (black_initial[piece_type] & SquareMask(s)) {
+          initial_position_hash ^= data[PieceSquareIndex(BLACK, piece_type, s)];
+          initial_material_hash ^= data[MaterialIndex(BLACK, piece_type, black_count++)];
+          if (piece_type == PAWN) initial_pawn_hash ^= data[PieceSquareIndex(BLACK, piece_type, s)];
+        }
+      }
+    initial_position_hash ^= data[WhiteCanCastleShort] ^ data[WhiteCanCastleLong] ^
+      data[BlackCanCastleShort] ^ data[BlackCanCastleLong];
   }
 
-  Hash GetHash(const BitBoardPosition &in, const PositionFlags &flags, uint8_t double_step_file) {
+  Hash GetHash(const BitBoardPosition &in, const PositionFlags &flags, uint8_t double_step_file) const {
     Hash ret = 0;
     for (uint8_t color = 0; color != 2; ++color)
       for (uint8_t piece_type = PAWN; piece_type != END_PIECES; ++piece_type)
@@ -419,33 +595,98 @@ struct ZobristHasher {
     if (!flags.b_cant_castle)      ret ^= data[BlackCanCastleShort];
     if (!flags.b_cant_castle_long) ret ^= data[BlackCanCastleLong];
     if (flags.to_move_color)       ret ^= data[BlackToMove];
-    if (double_step_file)          ret ^= data[DoubleStepPawnA + double_step_file - 1];
+    if (double_step_file)          ret ^= data[DoubleStepIndex(double_step_file)];
+    return ret;
+  }
+
+  Hash GetPawnHash(const BitBoardPosition &in) const {
+    Hash ret = 0;
+    for (uint8_t color = 0; color != 2; ++color)
+      for (SquareIter p(in.Pieces(color)[PAWN]); p; ++p)
+        ret ^= data[PieceSquareIndex(color, PAWN, p.GetSquare())];
+    return ret;
+  }
+
+  // Keys only how many of each piece each side has, e.g. for a material imbalance table.
+  Hash GetMaterialHash(const BitBoardPosition &in) const {
+    Hash ret = 0;
+    for (uint8_t color = 0; color != 2; ++color) {
+      PieceCount count;
+      count.Count(in.Pieces(color));
+      for (uint8_t piece_type = PAWN; piece_type != END_PIECES; ++piece_type)
+        for (uint8_t i = 0, l = count.Get(piece_type); i != l; ++i)
+          ret ^= data[MaterialIndex(color, piece_type, i)];
+    }
     return ret;
   }
 
-  static int PieceSquareIndex(bool color, uint8_t piece_type, uint8_t square) {
-    return 64 * ((color * 6) + (piece_type - 1)) + square;
+  static constexpr int PieceSquareIndex(bool color, uint8_t piece_type, uint8_t square) {
+    return End + 64 * ((color * 6) + (piece_type - 1)) + square;
+  }
+
+  // The n-th piece of a type held XORs in that piece's key for square n.
+  static constexpr int MaterialIndex(bool color, uint8_t piece_type, uint8_t count) {
+    return PieceSquareIndex(color, piece_type, count);
+  }
+
+  static constexpr int DoubleStepIndex(uint8_t double_step_file) { return DoubleStepPawnA + double_step_file - 1; }
+
+  static constexpr Hash SplitMix64(Hash *state) {
+    Hash z = (*state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
   }
 };
 
+static constexpr ZobristHasher zobrist_hasher;
+
+struct StateInfo {
+  Move move;
+  PositionFlags flags;
+  ZobristHasher::Hash hash, pawn_hash, material_hash;
+  BitBoard attack_cache[2];
+  uint8_t attack_cache_valid;
+};
+
 struct Position : public BitBoardPosition {
   Move move=0;
   uint16_t move_number=0;
   PositionFlags flags;
-  ZobristHasher::Hash hash;
+  ZobristHasher::Hash hash, pawn_hash, material_hash;
 
   Position() { Reset(); }
   Position(const string &b) { if (!LoadFEN(b)) Reset(); }
-  static Position FromByteBoard(const string &b) { Position p; p.LoadByteBoard(b); return p; }
+  static Position FromByteBoard(const string &b) {
+    Position p;
+    p.LoadByteBoard(b);
+    p.UpdateHashes();
+    return p;
+  }
 
   void Assign(const Position &p) { *this = p; }
   void Reset() {
     move = 0;
     move_number = 0;
     memzero(flags);
-    hash = 0;
     SetInitialPosition();
-    hash = Singleton<ZobristHasher>::Get()->initial_position_hash;
+    hash = zobrist_hasher.initial_position_hash;
+    pawn_hash = zobrist_hasher.initial_pawn_hash;
+    material_hash = zobrist_hasher.initial_material_hash;
+  }
+
+  void UpdateHashes() {
+    hash = zobrist_hasher.GetHash(*this, flags, EnPassantFile());
+    pawn_hash = zobrist_hasher.GetPawnHash(*this);
+    material_hash = zobrist_hasher.GetMaterialHash(*this);
+  }
+
+  // The file (1-8) of a double step the side to move can capture en passant, else 0.
+  uint8_t EnPassantFile() const { return flags.to_move_color ? EnPassantFile<BLACK>() : EnPassantFile<WHITE>(); }
+  template <int Us> uint8_t EnPassantFile() const {
+    if (!(move & MoveFlag::DoubleStepPawn)) return 0;
+    int8_t square_to = GetMoveToSquare(move);
+    return (PawnAttacks<!Us>(square_to + (Us == BLACK ? -8 : 8)) & Pieces<Us>()[PAWN]) ? SquareX(square_to) + 1 : 0;
   }
 
   bool operator==(const Position &p) const { return move == p.move && flags == p.flags && move_number == p.move_number &&
@@ -468,6 +709,7 @@ struct Position : public BitBoardPosition {
     if (!flags.w_cant_castle_long) castle.push_back('Q');
     if (!flags.b_cant_castle)      castle.push_back('k');
     if (!flags.b_cant_castle_long) castle.push_back('q');
+    if (move & MoveFlag::DoubleStepPawn) enpassant = SquareName(GetMoveToSquare(move) + (flags.to_move_color ? -8 : 8));
     if (!ret.size() || ret.back() != '/') return string();
     ret.pop_back();
     return StrCat(ret, flags.to_move_color ? " b " : " w ", castle.size()?castle:"-", " ",
@@ -495,6 +737,7 @@ struct Position : public BitBoardPosition {
     if (y != 0 || x != -1 || p == e) return false;
     SetAll(WHITE);
     SetAll(BLACK);
+    UpdateBoard();
     vector<string> args;
     int ind = p - b.begin();
     Split(StringPiece(b.data() + ind, b.size() - ind), isspace, nullptr, &args);
@@ -505,7 +748,14 @@ struct Position : public BitBoardPosition {
     flags.b_cant_castle      = !(args.size() > 1 && strchr(args[1].data(), 'k'));
     flags.fifty_move_rule_count = args.size() > 3 ? atoi(args[3]) : 0;
     move_number = args.size() > 4 ? (atoi(args[4])*2 - !flags.to_move_color - 1) : 0;
-    hash = Singleton<ZobristHasher>::Set()->GetHash(*this, flags, 0);
+    if (args.size() > 2 && args[2] != "-") {
+      // Record the double step that allows the capture as the last move, ignoring an impossible one
+      int8_t square = SquareID(args[2].c_str()), up = flags.to_move_color ? 8 : -8;
+      if (square >= 0 && SquareY(square) == (flags.to_move_color ? 2 : 5) &&
+          (Pieces(!flags.to_move_color)[PAWN] & SquareMask(square + up)))
+        move = Chess::GetMove(PAWN, square - up, square + up, 0, 0, MoveFlag::DoubleStepPawn);
+    }
+    UpdateHashes();
     return true;
   }
 
@@ -513,12 +763,14 @@ struct Position : public BitBoardPosition {
     return PawnAdvances(p, black) | PawnCaptures(p, black) | PawnEnPassant(p, black);
   }
   
-  BitBoard PawnEnPassant(int p, bool black) const {
+  BitBoard PawnEnPassant(int p, bool black) const { return black ? PawnEnPassant<BLACK>(p) : PawnEnPassant<WHITE>(p); }
+  template <int Us> BitBoard PawnEnPassant(int p) const {
     uint8_t square_to;
     if (!(move & MoveFlag::DoubleStepPawn) ||
-        SquareY((square_to = GetMoveToSquare(move))) != SquareY(p)) return 0;
-    if      (square_to + 1 == p) return SquareMask(black ? p-9 : p+7);
-    else if (square_to - 1 == p) return SquareMask(black ? p-7 : p+9);
+        SquareY((square_to = GetMoveToSquare(move))) != SquareY(p) ||
+        !(Pieces<!Us>()[PAWN] & SquareMask(square_to))) return 0;
+    if      (square_to + 1 == p) return SquareMask(Us == BLACK ? p-9 : p+7);
+    else if (square_to - 1 == p) return SquareMask(Us == BLACK ? p-7 : p+9);
     else                         return 0;
   }
 
@@ -542,15 +794,17 @@ struct Position : public BitBoardPosition {
   }
 
   BitBoard KingCastles(int p, bool black, BitBoard attacked) const {
+    return black ? KingCastles<BLACK>(p, attacked) : KingCastles<WHITE>(p, attacked);
+  }
+
+  template <int Us> BitBoard KingCastles(int p, BitBoard attacked) const {
+    const BitBoard path       = Us == BLACK ? black_castle_path       : white_castle_path;
+    const BitBoard long_path  = Us == BLACK ? black_castle_long_path  : white_castle_long_path;
+    const BitBoard long_clear = Us == BLACK ? black_castle_long_clear : white_castle_long_clear;
     if (SquareMask(p) & attacked) return 0;
-    BitBoard ret = 0;
-    if (black) {
-      if (!flags.b_cant_castle      && !(AllPieces() & black_castle_path)       && !(attacked & black_castle_path))      ret |= SquareMask(g8);
-      if (!flags.b_cant_castle_long && !(AllPieces() & black_castle_long_clear) && !(attacked & black_castle_long_path)) ret |= SquareMask(c8); 
-    } else {
-      if (!flags.w_cant_castle      && !(AllPieces() & white_castle_path)       && !(attacked & white_castle_path))      ret |= SquareMask(g1); 
-      if (!flags.w_cant_castle_long && !(AllPieces() & white_castle_long_clear) && !(attacked & white_castle_long_path)) ret |= SquareMask(c1); 
-    }
+    BitBoard ret = 0, occupied = AllPieces();
+    if (!(Us == BLACK ? flags.b_cant_castle      : flags.w_cant_castle)      && !(occupied & path)       && !(attacked & path))      ret |= SquareMask(Us == BLACK ? g8 : g1);
+    if (!(Us == BLACK ? flags.b_cant_castle_long : flags.w_cant_castle_long) && !(occupied & long_clear) && !(attacked & long_path)) ret |= SquareMask(Us == BLACK ? c8 : c1);
     return ret;
   }
 
@@ -564,30 +818,25 @@ struct Position : public BitBoardPosition {
     else                      FATAL("unknown piece ", piece);
   }
 
-  BitBoard PieceMovesOfType(int piece, int square, bool black, int type, BitBoard attacked=0) const {
-    if (piece == PAWN) {
-      if      (type == MoveFlag::EnPassant)      return PawnEnPassant(square, black);
-      else if (type == MoveFlag::DoubleStepPawn) return DoubleStepPawnAdvances(square, black);
-      else return SingleStepPawnAdvances(square, black) | PawnCaptures(square, black);
-    } else if (piece == KING) {
-      if      (type == MoveFlag::Castle) return KingCastles(square, black, attacked);
-      else                               return NormalKingMoves(square, black, attacked);
-    } else if (piece == KNIGHT) return KnightMoves(square, black);
-    else if (piece == BISHOP) return BishopMoves(square, black);
-    else if (piece == ROOK)   return RookMoves  (square, black);
-    else if (piece == QUEEN)  return QueenMoves (square, black);
-    else                      FATAL("unknown piece ", piece);
+  bool PlayerIllegalMove(int8_t piece, int8_t start_square, int8_t end_square, const Position &last_position) const {
+    Move m = last_position.GetPlayerMove(piece, start_square, end_square);
+    return !last_position.IsPseudoLegal(m) || !last_position.IsLegal(m);
   }
 
-  bool PlayerIllegalMove(int8_t piece, int8_t start_square, int8_t end_square, const Position &last_position) const {
-    bool move_color = flags.to_move_color;
-    return GetPieceColor(last_position.GetSquare(start_square)) != move_color ||
-      !(SquareMask(end_square) & last_position.PieceMoves
-        (piece, start_square, move_color, last_position.AllAttacks(!move_color)));
+  // The move a click or drag from start_square to end_square means here, promoting to a queen.
+  Move GetPlayerMove(int8_t piece, int8_t start_square, int8_t end_square) const {
+    uint8_t captured = GetPieceType(GetSquare(end_square)), promotion = 0;
+    uint32_t move_flags = 0;
+    if (piece == PAWN) {
+      if (SquareX(start_square) != SquareX(end_square) && !captured) { move_flags |= MoveFlag::EnPassant; captured = PAWN; }
+      if (abs(SquareY(end_square) - SquareY(start_square)) == 2) move_flags |= MoveFlag::DoubleStepPawn;
+      if (SquareY(end_square) == (flags.to_move_color ? 0 : 7)) promotion = QUEEN;
+    } else if (piece == KING && abs(SquareX(end_square) - SquareX(start_square)) > 1) move_flags |= MoveFlag::Castle;
+    return Chess::GetMove(piece, start_square, end_square, captured, promotion, move_flags);
   }
 
   void PlayerMakeMove(int8_t piece, int8_t start_square, int8_t end_square, const Position &last_position) {
-    static const vector<ZobristHasher::Hash> &zobrist = Singleton<ZobristHasher>::Get()->data;
+    const ZobristHasher::Hash *zobrist = zobrist_hasher.data;
     bool move_color = flags.to_move_color;
     move_number++;
     flags.to_move_color = move_number & 1;
@@ -596,8 +845,11 @@ struct Position : public BitBoardPosition {
     uint8_t promotion = 0, capture_square = en_passant ? (end_square + 8 * (move_color ? 1 : -1)) : end_square;
     Piece capture = last_position.GetSquare(capture_square);
     if (capture) {
+      uint8_t captured = GetPieceType(capture);
       ClearSquare(capture_square, move_color != WHITE, move_color != BLACK);
-      hash ^= zobrist[ZobristHasher::PieceSquareIndex(!move_color, GetPieceType(capture), capture_square)];
+      hash ^= zobrist[ZobristHasher::PieceSquareIndex(!move_color, captured, capture_square)];
+      material_hash ^= zobrist[ZobristHasher::MaterialIndex(!move_color, captured, Bit::Count(Pieces(!move_color)[captured]))];
+      if (captured == PAWN) pawn_hash ^= zobrist[ZobristHasher::PieceSquareIndex(!move_color, PAWN, capture_square)];
     }
     if (piece == KING && abs(SquareX(end_square) - SquareX(start_square)) > 1) 
       MoveRookForCastles(move_color, end_square);
@@ -605,11 +857,19 @@ struct Position : public BitBoardPosition {
       promotion = QUEEN;
       ClearSquare(end_square, move_color == WHITE, move_color == BLACK);
       SetSquare(end_square, GetPiece(move_color, promotion));
+      material_hash ^=
+        zobrist[ZobristHasher::MaterialIndex(move_color, PAWN, Bit::Count(Pieces(move_color)[PAWN]))] ^
+        zobrist[ZobristHasher::MaterialIndex(move_color, promotion, Bit::Count(Pieces(move_color)[promotion]) - 1)];
     }
     hash ^= zobrist[ZobristHasher::BlackToMove] ^
       zobrist[ZobristHasher::PieceSquareIndex(move_color, piece, start_square)] ^
       zobrist[ZobristHasher::PieceSquareIndex(move_color, promotion ? promotion : piece, end_square)];
+    if (piece == PAWN) pawn_hash ^= zobrist[ZobristHasher::PieceSquareIndex(move_color, PAWN, start_square)] ^
+      (promotion ? 0 : zobrist[ZobristHasher::PieceSquareIndex(move_color, PAWN, end_square)]);
     UpdateMove(true, piece, start_square, end_square, capture, promotion, en_passant ? MoveFlag::EnPassant : 0);
+    uint8_t last_ep_file = last_position.EnPassantFile(), ep_file = EnPassantFile();
+    if (last_ep_file) hash ^= zobrist[ZobristHasher::DoubleStepIndex(last_ep_file)];
+    if (ep_file)      hash ^= zobrist[ZobristHasher::DoubleStepIndex(ep_file)];
   }
 
   void UpdateMove(bool new_move, int8_t piece_type, int8_t square_from, int8_t square_to, int8_t captured,
@@ -619,57 +879,171 @@ struct Position : public BitBoardPosition {
 
     if (piece_type == PAWN && abs(SquareY(square_to) - SquareY(square_from)) == 2)
       move_flags |= MoveFlag::DoubleStepPawn;
-    if (InCheck(!piece_color, AllAttacks(piece_color)))
+    if (Checkers(!piece_color))
       move_flags |= MoveFlag::Check;
 
     move = Chess::GetMove(piece_type, square_from, square_to, captured, promotion, move_flags);
     if (new_move) UpdateFlagsForMove(piece_color, piece_type, square_from, square_to, captured);
   }
 
-  void ApplyValidatedMove(Move m) {
-    static const vector<ZobristHasher::Hash> &zobrist = Singleton<ZobristHasher>::Get()->data;
-    bool color = flags.to_move_color;
+  void MakeMove(Move m, StateInfo *st) { flags.to_move_color ? MakeMove<BLACK>(m, st) : MakeMove<WHITE>(m, st); }
+  template <int Us> void MakeMove(Move m, StateInfo *st) {
+    st->move = move;
+    st->flags = flags;
+    st->hash = hash;
+    st->pawn_hash = pawn_hash;
+    st->material_hash = material_hash;
+    st->attack_cache[WHITE] = attack_cache[WHITE];
+    st->attack_cache[BLACK] = attack_cache[BLACK];
+    st->attack_cache_valid = attack_cache_valid;
+    ApplyValidatedMove<Us>(m);
+  }
+
+  void UnmakeMove(Move m, const StateInfo &st) { flags.to_move_color ? UnmakeMove<WHITE>(m, st) : UnmakeMove<BLACK>(m, st); }
+  template <int Us> void UnmakeMove(Move m, const StateInfo &st) {
     int8_t square_from = GetMoveFromSquare(m), square_to = GetMoveToSquare(m);
     int8_t piece_type = GetMovePieceType(m), promotion = GetMovePromotion(m), captured;
-    Piece piece = ClearSquareOfKnownPiece(square_from, piece_type, color);
+    uint8_t rook_from, rook_to;
+    ClearSquareOfKnownPiece<Us>(square_to, promotion ? promotion : piece_type);
+    SetSquareOfKnownPiece<Us>(square_from, piece_type);
+    if ((captured = GetMoveCapture(m)))
+      SetSquareOfKnownPiece<!Us>((m & MoveFlag::EnPassant) ? (square_to + (Us == BLACK ? 8 : -8)) : square_to, captured);
+    if ((m & MoveFlag::Castle) && CastleRookSquares(square_to, &rook_from, &rook_to)) {
+      ClearSquareOfKnownPiece<Us>(rook_to, ROOK);
+      SetSquareOfKnownPiece<Us>(rook_from, ROOK);
+    }
+    move = st.move;
+    flags = st.flags;
+    hash = st.hash;
+    pawn_hash = st.pawn_hash;
+    material_hash = st.material_hash;
+    attack_cache[WHITE] = st.attack_cache[WHITE];
+    attack_cache[BLACK] = st.attack_cache[BLACK];
+    attack_cache_valid = st.attack_cache_valid;
+    move_number--;
+  }
+
+  void ApplyValidatedMove(Move m) { flags.to_move_color ? ApplyValidatedMove<BLACK>(m) : ApplyValidatedMove<WHITE>(m); }
+  template <int Us> void ApplyValidatedMove(Move m) {
+    const ZobristHasher::Hash *zobrist = zobrist_hasher.data;
+    int8_t square_from = GetMoveFromSquare(m), square_to = GetMoveToSquare(m);
+    int8_t piece_type = GetMovePieceType(m), promotion = GetMovePromotion(m), captured;
+    uint8_t ep_file = EnPassantFile<Us>();
+    if (ep_file) hash ^= zobrist[ZobristHasher::DoubleStepIndex(ep_file)];
+    ClearSquareOfKnownPiece<Us>(square_from, piece_type);
     if ((captured = GetMoveCapture(m))) {
-      uint8_t capture_square = (m & MoveFlag::EnPassant) ? (square_to + 8 * (color ? 1 : -1)) : square_to;
-      ClearSquareOfKnownPiece(capture_square, captured, !color);
-      hash ^= zobrist[ZobristHasher::PieceSquareIndex(!color, captured, capture_square)];
+      uint8_t capture_square = (m & MoveFlag::EnPassant) ? (square_to + (Us == BLACK ? 8 : -8)) : square_to;
+      ClearSquareOfKnownPiece<!Us>(capture_square, captured);
+      hash ^= zobrist[ZobristHasher::PieceSquareIndex(!Us, captured, capture_square)];
+      material_hash ^= zobrist[ZobristHasher::MaterialIndex(!Us, captured, Bit::Count(Pieces<!Us>()[captured]))];
+      if (captured == PAWN) pawn_hash ^= zobrist[ZobristHasher::PieceSquareIndex(!Us, PAWN, capture_square)];
     }
-    if (m & MoveFlag::Castle) MoveRookForCastles(color, square_to);
-    SetSquare(square_to, promotion ? GetPiece(color, promotion) : piece);
+    if (m & MoveFlag::Castle) MoveRookForCastles<Us>(square_to);
+    SetSquareOfKnownPiece<Us>(square_to, promotion ? promotion : piece_type);
     move = m;
     move_number++;
-    flags.to_move_color = !color;
-    UpdateFlagsForMove(color, piece_type, square_from, square_to, captured);
+    flags.to_move_color = !Us;
+    UpdateFlagsForMove<Us>(piece_type, square_from, square_to, captured);
     hash ^= zobrist[ZobristHasher::BlackToMove] ^
-      zobrist[ZobristHasher::PieceSquareIndex(color, piece_type, square_from)] ^
-      zobrist[ZobristHasher::PieceSquareIndex(color, promotion ? promotion : piece_type, square_to)];
+      zobrist[ZobristHasher::PieceSquareIndex(Us, piece_type, square_from)] ^
+      zobrist[ZobristHasher::PieceSquareIndex(Us, promotion ? promotion : piece_type, square_to)];
+    if (piece_type == PAWN) {
+      pawn_hash ^= zobrist[ZobristHasher::PieceSquareIndex(Us, PAWN, square_from)];
+      if (!promotion) pawn_hash ^= zobrist[ZobristHasher::PieceSquareIndex(Us, PAWN, square_to)];
+      else material_hash ^=
+        zobrist[ZobristHasher::MaterialIndex(Us, PAWN, Bit::Count(Pieces<Us>()[PAWN]))] ^
+        zobrist[ZobristHasher::MaterialIndex(Us, promotion, Bit::Count(Pieces<Us>()[promotion]) - 1)];
+      if ((m & MoveFlag::DoubleStepPawn) && (ep_file = EnPassantFile<!Us>()))
+        hash ^= zobrist[ZobristHasher::DoubleStepIndex(ep_file)];
+    }
+  }
+
+  bool GivesCheck(Move m, bool color) const { return color ? GivesCheck<BLACK>(m) : GivesCheck<WHITE>(m); }
+  template <int Us> bool GivesCheck(Move m) const {
+    BitBoard king = Pieces<!Us>()[KING];
+    if (!king) return false;
+    const BitBoard *pieces = Pieces<Us>();
+    int8_t king_square = ffsll(king) - 1, square_from = GetMoveFromSquare(m), square_to = GetMoveToSquare(m);
+    uint8_t piece_type = GetMovePromotion(m) ? GetMovePromotion(m) : GetMovePieceType(m), rook_from, rook_to;
+    BitBoard from_mask = SquareMask(square_from), to_mask = SquareMask(square_to);
+    BitBoard occupied = (AllPieces() & ~from_mask) | to_mask;
+    BitBoard rooks   = (pieces[ROOK]   | pieces[QUEEN]) & ~from_mask;
+    BitBoard bishops = (pieces[BISHOP] | pieces[QUEEN]) & ~from_mask;
+    if (m & MoveFlag::EnPassant) occupied &= ~SquareMask(square_to + (Us == BLACK ? 8 : -8));
+    if ((m & MoveFlag::Castle) && CastleRookSquares(square_to, &rook_from, &rook_to)) {
+      occupied ^= SquareMask(rook_from) | SquareMask(rook_to);
+      rooks    ^= SquareMask(rook_from) | SquareMask(rook_to);
+    }
+    if (piece_type == ROOK   || piece_type == QUEEN) rooks   |= to_mask;
+    if (piece_type == BISHOP || piece_type == QUEEN) bishops |= to_mask;
+    if ((RookAttacks(king_square, occupied) & rooks) || (BishopAttacks(king_square, occupied) & bishops)) return true;
+    if      (piece_type == PAWN)   return PawnAttacks<Us>(square_to) & king;
+    else if (piece_type == KNIGHT) return knight_occupancy_mask[square_to] & king;
+    else                           return false;
+  }
+
+  // Whether m, e.g. from a hash table, is one GenerateMoves could produce here, ignoring king safety.
+  bool IsPseudoLegal(Move m) const { return flags.to_move_color ? IsPseudoLegal<BLACK>(m) : IsPseudoLegal<WHITE>(m); }
+  template <int Us> bool IsPseudoLegal(Move m) const {
+    const BitBoard *pieces = Pieces<Us>();
+    int8_t square_from = GetMoveFromSquare(m), square_to = GetMoveToSquare(m);
+    uint8_t piece_type = GetMovePieceType(m), promotion = GetMovePromotion(m), captured = GetMoveCapture(m);
+    BitBoard to_mask = SquareMask(square_to);
+    bool en_passant = m & MoveFlag::EnPassant, castle = m & MoveFlag::Castle, double_step = m & MoveFlag::DoubleStepPawn;
+    if (piece_type < PAWN || piece_type > KING || !(pieces[piece_type] & SquareMask(square_from)) ||
+        (pieces[ALL] & to_mask) || captured == KING ||
+        captured != (en_passant ? uint8_t(PAWN) : uint8_t(GetPieceType(board[square_to])))) return false;
+
+    if (piece_type != PAWN) {
+      if (promotion || en_passant || double_step || (castle && piece_type != KING)) return false;
+      if (castle) return KingCastles<Us>(square_from, AllAttacks(!Us)) & to_mask;
+      return PieceAttacks(piece_type, square_from, Us) & to_mask;
+    }
+    if (castle || double_step != (abs(SquareY(square_to) - SquareY(square_from)) == 2) ||
+        (SquareY(square_to) == (Us == BLACK ? 0 : 7)) != (promotion != 0) ||
+        (promotion && (promotion < KNIGHT || promotion > QUEEN))) return false;
+    if (en_passant) return PawnEnPassant<Us>(square_from) & to_mask;
+    if (captured)   return PawnAttacks<Us>(square_from) & to_mask;
+    return (SingleStepPawnAdvances<Us>(square_from) | DoubleStepPawnAdvances<Us>(square_from)) & to_mask;
+  }
+
+  // Whether pseudo-legal m leaves the mover's king safe, by one attackers-to-king query.
+  bool IsLegal(Move m) const { return flags.to_move_color ? IsLegal<BLACK>(m) : IsLegal<WHITE>(m); }
+  template <int Us> bool IsLegal(Move m) const {
+    BitBoard king = Pieces<Us>()[KING];
+    if (!king || (m & MoveFlag::Castle)) return true;
+    int8_t square_from = GetMoveFromSquare(m), square_to = GetMoveToSquare(m);
+    BitBoard to_mask = SquareMask(square_to), captured_mask = to_mask;
+    if (m & MoveFlag::EnPassant) captured_mask = SquareMask(square_to + (Us == BLACK ? 8 : -8));
+    BitBoard occupied = (AllPieces() & ~SquareMask(square_from) & ~captured_mask) | to_mask;
+    int king_square = GetMovePieceType(m) == KING ? square_to : ffsll(king) - 1;
+    return !(AttackersTo(king_square, occupied) & Pieces<!Us>()[ALL] & ~captured_mask);
   }
 
   void MoveRookForCastles(bool color, int8_t square_to) {
-    static const vector<ZobristHasher::Hash> &zobrist = Singleton<ZobristHasher>::Get()->data;
+    color ? MoveRookForCastles<BLACK>(square_to) : MoveRookForCastles<WHITE>(square_to);
+  }
+
+  template <int Us> void MoveRookForCastles(int8_t square_to) {
+    const ZobristHasher::Hash *zobrist = zobrist_hasher.data;
     uint8_t rook_from, rook_to; 
-    switch(square_to) {
-      case g1: rook_from = h1; rook_to = f1; break;
-      case g8: rook_from = h8; rook_to = f8; break;
-      case c1: rook_from = a1; rook_to = d1; break;
-      case c8: rook_from = a8; rook_to = d8; break;
-      default: FATAL("invalid castle");      break;
-    }
-    uint8_t rook = ClearSquareOfKnownPiece(rook_from, ROOK, color);
-    DEBUG_CHECK_EQ(int(GetPiece(color, ROOK)), int(rook));
+    if (!CastleRookSquares(square_to, &rook_from, &rook_to)) FATAL("invalid castle");
+    ClearSquareOfKnownPiece<Us>(rook_from, ROOK);
     DEBUG_CHECK_EQ(int(GetPiece(WHITE, 0)), int(GetSquare(rook_to)));
-    SetSquare(rook_to, rook);
+    SetSquareOfKnownPiece<Us>(rook_to, ROOK);
     hash ^= 
-      zobrist[ZobristHasher::PieceSquareIndex(color, ROOK, rook_from)] ^
-      zobrist[ZobristHasher::PieceSquareIndex(color, ROOK, rook_to)];
+      zobrist[ZobristHasher::PieceSquareIndex(Us, ROOK, rook_from)] ^
+      zobrist[ZobristHasher::PieceSquareIndex(Us, ROOK, rook_to)];
   }
 
   void UpdateFlagsForMove(bool piece_color, int8_t piece_type, int8_t square_from, int8_t square_to, int8_t captured) {
-    static const vector<ZobristHasher::Hash> &zobrist = Singleton<ZobristHasher>::Get()->data;
-    if (piece_color == WHITE) {
+    if (piece_color) UpdateFlagsForMove<BLACK>(piece_type, square_from, square_to, captured);
+    else             UpdateFlagsForMove<WHITE>(piece_type, square_from, square_to, captured);
+  }
+
+  template <int Us> void UpdateFlagsForMove(int8_t piece_type, int8_t square_from, int8_t square_to, int8_t captured) {
+    const ZobristHasher::Hash *zobrist = zobrist_hasher.data;
+    if (Us == WHITE) {
       if (!flags.w_cant_castle      && (square_from == e1 || square_from == h1)) { flags.w_cant_castle      = true; hash ^= zobrist[ZobristHasher::WhiteCanCastleShort]; }
       if (!flags.w_cant_castle_long && (square_from == e1 || square_from == a1)) { flags.w_cant_castle_long = true; hash ^= zobrist[ZobristHasher::WhiteCanCastleLong]; }
       if      (!flags.b_cant_castle_long && square_to == a8)                     { flags.b_cant_castle_long = true; hash ^= zobrist[ZobristHasher::BlackCanCastleLong]; }
@@ -688,6 +1062,10 @@ struct Position : public BitBoardPosition {
 struct SearchStats {
   struct Total {
     int nodes=0, captures=0, promotions=0, castles=0, enpassants=0, checks=0, checkmates=0;
+    void Add(const Total &x) {
+      nodes += x.nodes;  captures += x.captures;  promotions += x.promotions;  castles += x.castles;
+      enpassants += x.enpassants;  checks += x.checks;  checkmates += x.checkmates;
+    }
     void CountMove(Move move) {
       nodes++;
       if (GetMoveCapture(move))       captures++;
@@ -715,104 +1093,760 @@ struct SearchStats {
   }
 };
 
-vector<Move> GenerateMoves(const Position &in, bool color, PieceCount *piece_count=0) {
-  vector<Move> ret;
-  uint8_t square_from, square_to;
-  BitBoard attacked = in.AllAttacks(!color);
-  for (int piece_type = PAWN; piece_type != END_PIECES; ++piece_type)
-    for (SquareIter p(in.Pieces(color)[piece_type]); p; ++p) {
-      square_from = p.GetSquare();
-      if (piece_count) piece_count->Add(piece_type);
-      for (auto *move_type = special_moves[piece_type]; /**/; move_type++) {
-        for (SquareIter m(in.PieceMovesOfType(piece_type, square_from, color, *move_type, attacked)); m; ++m) {
-          Position position = in;
-          square_to = m.GetSquare();
-          uint8_t capture_square = ((*move_type) & MoveFlag::EnPassant) ? (square_to + 8 * (color ? 1 : -1)) : square_to;
-          Piece piece = position.ClearSquareOfKnownPiece(square_from, piece_type, color);
-          Piece captured_piece = position.ClearSquare(capture_square, color != WHITE, color != BLACK);
-          uint8_t captured_piece_type = GetPieceType(captured_piece);
-          position.move_number++;
-          position.flags.to_move_color = !color;
-
-          if (piece_type == KING && abs(SquareX(square_to) - SquareX(square_from)) > 1) 
-            position.MoveRookForCastles(color, square_to);
-          if (piece_type == PAWN && SquareY(square_to) == (color ? 0 : 7)) {
-            for (uint8_t promotion = QUEEN; promotion > PAWN; --promotion) {
-              Position pos = position;
-              pos.SetSquare(square_to, GetPiece(color, promotion));
-              pos.UpdateMove(true, GetPieceType(piece), square_from, square_to, captured_piece_type, promotion, 0);
-              if (!pos.InCheck(color, pos.AllAttacks(!color))) ret.push_back(pos.move);
-            }
-          } else {
-            position.SetSquare(square_to, piece);
-            position.UpdateMove(true, GetPieceType(piece), square_from, square_to, captured_piece_type, 0, *move_type);
-            if (!position.InCheck(color, position.AllAttacks(!color))) ret.push_back(position.move);
-          }
-        }
-        if (!*move_type) break;
+struct MoveList {
+  static const int Size = 256;
+  Move data[Size];
+  int count=0;
+
+  /**/  Move *begin()       { return data; }
+  const Move *begin() const { return data; }
+  /**/  Move *end()         { return data + count; }
+  const Move *end()   const { return data + count; }
+  int size() const { return count; }
+  bool empty() const { return !count; }
+  void clear() { count = 0; }
+  void push_back(Move m) { DEBUG_CHECK_RANGE(count, 0, Size); data[count++] = m; }
+  /**/  Move &operator[](int i)       { return data[i]; }
+  const Move &operator[](int i) const { return data[i]; }
+};
+
+// Check squares per piece type and discovered-check candidates, computed once per generated position.
+struct CheckInfo {
+  BitBoard check_squares[END_PIECES] = {}, discovered = 0;
+  int8_t king_square = -1;
+
+  template <int Us> void Init(const Position &in) {
+    const BitBoard *pieces = in.Pieces<Us>();
+    BitBoard king = in.Pieces<!Us>()[KING], occupied = in.AllPieces();
+    if (!king) return;
+    king_square = ffsll(king) - 1;
+    check_squares[PAWN]   = in.PawnAttacks<!Us>(king_square);
+    check_squares[KNIGHT] = knight_occupancy_mask[king_square];
+    check_squares[BISHOP] = Position::BishopAttacks(king_square, occupied);
+    check_squares[ROOK]   = Position::RookAttacks  (king_square, occupied);
+    check_squares[QUEEN]  = check_squares[BISHOP] | check_squares[ROOK];
+    discovered = in.SliderBlockers(king_square, pieces[ROOK] | pieces[QUEEN], pieces[BISHOP] | pieces[QUEEN], pieces[ALL]);
+  }
+
+  template <int Us> bool GivesCheck(const Position &in, Move m) const {
+    if (king_square < 0) return false;
+    if ((m & (MoveFlag::EnPassant | MoveFlag::Castle)) || GetMovePromotion(m)) return in.GivesCheck<Us>(m);
+    uint8_t square_from = GetMoveFromSquare(m), square_to = GetMoveToSquare(m);
+    return (check_squares[GetMovePieceType(m)] & SquareMask(square_to)) ||
+      ((discovered & SquareMask(square_from)) && !(LineMask(king_square, square_from) & SquareMask(square_to)));
+  }
+};
+
+template <int Us> void AddGeneratedMoves(const Position &in, const CheckInfo &check_info, uint8_t piece_type,
+                                         uint8_t square_from, BitBoard targets, uint32_t move_flags, MoveList *ret) {
+  for (SquareIter m(targets); m; ++m) {
+    uint8_t square_to = m.GetSquare();
+    uint32_t flags = move_flags;
+    uint8_t captured = (flags & MoveFlag::EnPassant) ? uint8_t(PAWN) : uint8_t(GetPieceType(in.GetSquare(square_to, Us, !Us)));
+    if (piece_type == PAWN && abs(SquareY(square_to) - SquareY(square_from)) == 2) flags |= MoveFlag::DoubleStepPawn;
+    if (piece_type == PAWN && SquareY(square_to) == (Us == BLACK ? 0 : 7)) {
+      for (uint8_t promotion = QUEEN; promotion > PAWN; --promotion) {
+        Move move = GetMove(piece_type, square_from, square_to, captured, promotion, flags);
+        ret->push_back(check_info.GivesCheck<Us>(in, move) ? (move | MoveFlag::Check) : move);
       }
+    } else {
+      Move move = GetMove(piece_type, square_from, square_to, captured, 0, flags);
+      ret->push_back(check_info.GivesCheck<Us>(in, move) ? (move | MoveFlag::Check) : move);
     }
-  return ret;
+  }
+}
+
+struct MoveGenType { enum { Captures=1, Quiets=2, All=3, Evasions=4, NoCheckFlags=8 }; };
+
+template <int Us> void AddPawnMoves(const Position &in, const CheckInfo &check_info, BitBoard targets, int delta, uint32_t move_flags, MoveList *ret) {
+  const BitBoard promotion_rank = Us == BLACK ? 0xffULL : (0xffULL << 56);
+  for (SquareIter m(targets & promotion_rank); m; ++m)
+    AddGeneratedMoves<Us>(in, check_info, PAWN, m.GetSquare() - delta, SquareMask(m.GetSquare()), move_flags, ret);
+  for (SquareIter m(targets & ~promotion_rank); m; ++m) {
+    uint8_t square_to = m.GetSquare();
+    Move move = GetMove(PAWN, square_to - delta, square_to, GetPieceType(in.board[square_to]), 0, move_flags);
+    ret->push_back(check_info.GivesCheck<Us>(in, move) ? (move | MoveFlag::Check) : move);
+  }
+}
+
+// Unpinned pawns move a whole bitboard at a time; pinned pawns and en passant use per-square masks.
+template <int Us> void GeneratePawnMoves(const Position &in, const CheckInfo &check_info, int type, BitBoard target, BitBoard allowed,
+                                         uint8_t king_square, BitBoard pinned, BitBoard checkers, MoveList *ret) {
+  const int up = Us == BLACK ? -8 : 8, up_a = Us == BLACK ? -7 : 9, up_h = Us == BLACK ? -9 : 7;
+  const BitBoard double_step_rank = Us == BLACK ? (0xffULL << 40) : (0xffULL << 16);
+  const BitBoard *pieces = in.Pieces<Us>(), *enemy = in.Pieces<!Us>();
+  BitBoard occupied = in.AllPieces(), pawns = pieces[PAWN] & ~pinned;
+  BitBoard single_step = ShiftBoard<up>(pawns) & ~occupied;
+  AddPawnMoves<Us>(in, check_info, single_step & allowed, up, 0, ret);
+  AddPawnMoves<Us>(in, check_info, ShiftBoard<up>(single_step & double_step_rank) & ~occupied & allowed, 2 * up, MoveFlag::DoubleStepPawn, ret);
+  AddPawnMoves<Us>(in, check_info, ShiftBoard<up_a>(pawns & ~file_a_mask) & enemy[ALL] & allowed, up_a, 0, ret);
+  AddPawnMoves<Us>(in, check_info, ShiftBoard<up_h>(pawns & ~file_h_mask) & enemy[ALL] & allowed, up_h, 0, ret);
+
+  for (SquareIter p(pieces[PAWN] & pinned); p; ++p) {
+    uint8_t square_from = p.GetSquare();
+    BitBoard moves = in.SingleStepPawnAdvances<Us>(square_from) | in.DoubleStepPawnAdvances<Us>(square_from) |
+      in.PawnCaptures<Us>(square_from);
+    AddGeneratedMoves<Us>(in, check_info, PAWN, square_from, moves & allowed & LineMask(king_square, square_from), 0, ret);
+  }
+
+  if (!(type & MoveGenType::Captures) || !(in.move & MoveFlag::DoubleStepPawn)) return;
+  uint8_t en_passant_square = GetMoveToSquare(in.move) + up;
+  for (SquareIter p(pieces[PAWN] & in.PawnAttacks<!Us>(en_passant_square)); p; ++p) {
+    uint8_t square_from = p.GetSquare();
+    BitBoard pin_mask = (SquareMask(square_from) & pinned) ? LineMask(king_square, square_from) : ~0ULL;
+    BitBoard en_passant = in.PawnEnPassant<Us>(square_from) & pin_mask & target;
+    if (!en_passant) continue;
+    uint8_t capture_square = en_passant_square - up;
+    BitBoard after = (occupied ^ SquareMask(square_from) ^ SquareMask(capture_square)) | en_passant;
+    if (!(checkers & ~SquareMask(capture_square) & (enemy[PAWN] | enemy[KNIGHT])) &&
+        !(Position::RookAttacks  (king_square, after) & (enemy[ROOK]   | enemy[QUEEN])) &&
+        !(Position::BishopAttacks(king_square, after) & (enemy[BISHOP] | enemy[QUEEN])))
+      AddGeneratedMoves<Us>(in, check_info, PAWN, square_from, en_passant, MoveFlag::EnPassant, ret);
+  }
+}
+
+template <int Us> void GenerateMovesOfType(const Position &in, int type, BitBoard target, MoveList *ret) {
+  const BitBoard *pieces = in.Pieces<Us>(), *enemy = in.Pieces<!Us>();
+  if (!pieces[KING]) return;
+  CheckInfo check_info;
+  if (!(type & MoveGenType::NoCheckFlags)) check_info.Init<Us>(in);
+  type &= ~MoveGenType::NoCheckFlags;
+
+  uint8_t king_square = ffsll(pieces[KING]) - 1;
+  BitBoard occupied = in.AllPieces(), checkers = in.Checkers<Us>();
+  if (type == MoveGenType::Evasions) { if (!checkers) return; type = MoveGenType::All; }
+
+  BitBoard promotion_rank = Us == BLACK ? 0xffULL : (0xffULL << 56), attacked = in.AllAttacks(!Us);
+  BitBoard allowed = target & (((type & MoveGenType::Captures) ? enemy[ALL] : 0) | ((type & MoveGenType::Quiets) ? ~occupied : 0));
+  BitBoard pawn_allowed = target & (((type & MoveGenType::Captures) ? (enemy[ALL] | promotion_rank) : 0) |
+                                    ((type & MoveGenType::Quiets)   ? (~occupied & ~promotion_rank) : 0));
+  BitBoard king_targets = king_occupancy_mask[king_square] & ~attacked & allowed;
+  for (SquareIter c(checkers & ~enemy[PAWN] & ~enemy[KNIGHT]); c; ++c)
+    king_targets &= ~(LineMask(king_square, c.GetSquare()) ^ SquareMask(c.GetSquare()));
+  AddGeneratedMoves<Us>(in, check_info, KING, king_square, king_targets, 0, ret);
+  if (checkers & (checkers - 1)) return;
+
+  BitBoard pinned = in.PinnedPieces<Us>(), evasion_mask = ~0ULL;
+  if (checkers) evasion_mask = checkers | BetweenMask(king_square, ffsll(checkers) - 1);
+  else if (type & MoveGenType::Quiets)
+    AddGeneratedMoves<Us>(in, check_info, KING, king_square, in.KingCastles<Us>(king_square, attacked) & target, MoveFlag::Castle, ret);
+
+  GeneratePawnMoves<Us>(in, check_info, type, target, pawn_allowed & evasion_mask, king_square, pinned, checkers, ret);
+
+  for (int piece_type = KNIGHT; piece_type != KING; ++piece_type)
+    for (SquareIter p(pieces[piece_type]); p; ++p) {
+      uint8_t square_from = p.GetSquare();
+      BitBoard pin_mask = (SquareMask(square_from) & pinned) ? LineMask(king_square, square_from) : ~0ULL;
+      BitBoard moves = in.PieceMoves(piece_type, square_from, Us) & allowed;
+      AddGeneratedMoves<Us>(in, check_info, piece_type, square_from, moves & evasion_mask & pin_mask, 0, ret);
+    }
+}
+
+void GenerateMovesOfType(const Position &in, bool color, int type, BitBoard target, MoveList *ret) {
+  if (color) GenerateMovesOfType<BLACK>(in, type, target, ret);
+  else       GenerateMovesOfType<WHITE>(in, type, target, ret);
+}
+
+void GenerateCaptures(const Position &in, bool color, MoveList *ret, BitBoard target=~0ULL) {
+  ret->clear();
+  GenerateMovesOfType(in, color, MoveGenType::Captures, target, ret);
+}
+
+void GenerateQuiets(const Position &in, bool color, MoveList *ret, BitBoard target=~0ULL) {
+  ret->clear();
+  GenerateMovesOfType(in, color, MoveGenType::Quiets, target, ret);
+}
+
+void GenerateEvasions(const Position &in, bool color, MoveList *ret, BitBoard target=~0ULL) {
+  ret->clear();
+  GenerateMovesOfType(in, color, MoveGenType::Evasions, target, ret);
+}
+
+void GenerateMoves(const Position &in, bool color, MoveList *ret, PieceCount *piece_count=0) {
+  ret->clear();
+  if (piece_count) piece_count->Count(in.Pieces(color));
+  GenerateMovesOfType(in, color, MoveGenType::All, ~0ULL, ret);
+}
+
+vector<Move> GenerateMoves(const Position &in, bool color, PieceCount *piece_count=0) {
+  MoveList moves;
+  GenerateMoves(in, color, &moves, piece_count);
+  return vector<Move>(moves.begin(), moves.end());
 }
 
-float StaticEvaluation(Position in) {
-  static float mate_score=10000, king_weight=200, queen_weight=9, rook_weight=5, knight_weight=3,
-               bishop_weight=3, pawn_weight=1, mobility_weight=.1;
+// Material in pawns, indexed by piece type.
+static constexpr float piece_weight[END_PIECES] = { 0, 1, 3, 3, 5, 9, 200 };
+
+// Mated ply plies from the root scores MatedScore(ply); anything within max_search_ply of mate_score is a mate.
+static constexpr float mate_score = 10000;
+static constexpr int max_search_ply = 256;
+inline float MatedScore(int ply) { return ply - mate_score; }
+inline bool IsMateScore(float score) { return fabs(score) >= mate_score - max_search_ply; }
+inline int MateDistance(float score) { return int(lrintf(mate_score - fabs(score))); }
+
+float StaticEvaluation(const Position &in) {
+  static float mobility_weight=.1;
   PieceCount my_material, opponent_material;
   bool my_color = in.flags.to_move_color;
-  auto my_moves = GenerateMoves(in, my_color, &my_material);
+  MoveList my_moves, opponent_moves;
+  GenerateMoves(in, my_color, &my_moves, &my_material);
   if (my_moves.empty())
     return in.InCheck(my_color, in.AllAttacks(!my_color)) ? (-mate_score * (my_color ? -1 : 1)) : 0;
-  in.move_number++;
-  in.move &= ~GetMoveFlagMask();
-  in.flags.to_move_color = !my_color;
-  auto opponent_moves = GenerateMoves(in, !my_color, &opponent_material);
+  GenerateMoves(in, !my_color, &opponent_moves, &opponent_material);
   auto &white_moves = my_color ? opponent_moves : my_moves;
   auto &black_moves = my_color ? my_moves : opponent_moves;
   auto &white_material = my_color ? opponent_material : my_material;
   auto &black_material = my_color ? my_material : opponent_material;
   return
-    king_weight     * (int(white_material.king_count)   - int(black_material.king_count))   +
-    queen_weight    * (int(white_material.queen_count)  - int(black_material.queen_count))  +
-    rook_weight     * (int(white_material.rook_count)   - int(black_material.rook_count))   +
-    knight_weight   * (int(white_material.knight_count) - int(black_material.knight_count)) +
-    bishop_weight   * (int(white_material.bishop_count) - int(black_material.bishop_count)) +
-    pawn_weight     * (int(white_material.pawn_count)   - int(black_material.pawn_count))   +
-    mobility_weight * (int(white_moves.size())          - int(black_moves.size()));
+    piece_weight[KING]   * (int(white_material.king_count)   - int(black_material.king_count))   +
+    piece_weight[QUEEN]  * (int(white_material.queen_count)  - int(black_material.queen_count))  +
+    piece_weight[ROOK]   * (int(white_material.rook_count)   - int(black_material.rook_count))   +
+    piece_weight[KNIGHT] * (int(white_material.knight_count) - int(black_material.knight_count)) +
+    piece_weight[BISHOP] * (int(white_material.bishop_count) - int(black_material.bishop_count)) +
+    piece_weight[PAWN]   * (int(white_material.pawn_count)   - int(black_material.pawn_count))   +
+    mobility_weight      * (int(white_moves.size())          - int(black_moves.size()));
 }
 
 inline bool MoveSort(Move l, Move r) { return r < l; }
+inline bool SameMove(Move l, Move r) { return !((l ^ r) & ~Move(MoveFlag::Check | MoveFlag::Killer)); }
 inline bool PositionMoveSort(const Position &l, const Position &r) { return MoveSort(l.move, r.move); }
 
-void FullSearch(Position in, bool color, SearchStats *stats, int depth=0, SearchStats::Total *divide=0) {
-  auto moves = GenerateMoves(in, color);
+template <int Us> void FullSearch(Position *in, SearchStats *stats, int depth=0, SearchStats::Total *divide=0) {
+  StateInfo st;
+  MoveList moves;
+  GenerateMovesOfType<Us>(*in, MoveGenType::All, ~0ULL, &moves);
   for (auto &m : moves) {
     unsigned char move_from = GetMoveFromSquare(m), move_to = GetMoveToSquare(m);
     if (!depth && stats->divide_total) divide = &(*stats->divide_total)[GetMove(GetMovePieceType(m), move_from, move_to, 0, 0, 0)];
     if (stats) stats->CountMove(m, depth, divide);
     if (depth+1 >= stats->max_depth) continue;
-    Position position = in;
-    position.ApplyValidatedMove(m);
-    FullSearch(position, !color, stats, depth+1, divide);
+    in->MakeMove<Us>(m, &st);
+    FullSearch<!Us>(in, stats, depth+1, divide);
+    in->UnmakeMove<Us>(m, st);
   }
 }
 
-pair<Move, float> AlphaBetaNegamaxSearch(Position in, bool color, float alpha, float beta, int depth) {
-  if (!depth) return make_pair(in.move, StaticEvaluation(in) * (color ? -1 : 1));
-  float v;
-  pair<Move, float> best(0, -INFINITY);
+void FullSearch(Position *in, bool color, SearchStats *stats, int depth=0, SearchStats::Total *divide=0) {
+  if (color) FullSearch<BLACK>(in, stats, depth, divide);
+  else       FullSearch<WHITE>(in, stats, depth, divide);
+}
+
+void FullSearch(Position in, bool color, SearchStats *stats) { FullSearch(&in, color, stats); }
+
+// Subtree node counts keyed by Position::hash and depth, verified against the full 64-bit key.
+struct PerftCache {
+  struct Entry { ZobristHasher::Hash key=0; uint64_t nodes=0; };
+  vector<Entry> table;
+  uint64_t hits=0, hash_mismatches=0;
+  bool check_hash=false;
+  PerftCache(int log2_entries) : table(size_t(1) << log2_entries) {}
+
+  static ZobristHasher::Hash Key(ZobristHasher::Hash hash, int depth) { return hash ^ (depth * 0x9e3779b97f4a7c15ULL); }
+  Entry *GetEntry(ZobristHasher::Hash key) { return &table[key & (table.size() - 1)]; }
+  void CheckHash(const Position &in) {
+    if (in.hash          != zobrist_hasher.GetHash(in, in.flags, in.EnPassantFile()) ||
+        in.pawn_hash     != zobrist_hasher.GetPawnHash(in) ||
+        in.material_hash != zobrist_hasher.GetMaterialHash(in)) hash_mismatches++;
+  }
+  Entry *Probe(const Position &in, int depth, ZobristHasher::Hash *key) { return GetEntry((*key = Key(in.hash, depth))); }
+};
+
+// Bulk-counting perft, nodes only; FullSearch gives the per-category SearchStats.
+template <int Us> uint64_t Perft(Position *in, int depth, PerftCache *cache=0, const atomic<bool> *stop=0) {
+  if (depth <= 0) return 1;
+  if (stop && depth > 2 && stop->load(memory_order_relaxed)) return 0;
+  if (cache && cache->check_hash) cache->CheckHash(*in);
+  PerftCache::Entry *entry = nullptr;
+  ZobristHasher::Hash key = 0;
+  if (cache && depth > 1 && (entry = cache->Probe(*in, depth, &key)) && entry->key == key) {
+    cache->hits++;
+    return entry->nodes;
+  }
+  MoveList moves;
+  GenerateMovesOfType<Us>(*in, MoveGenType::All | MoveGenType::NoCheckFlags, ~0ULL, &moves);
+  if (depth == 1) return moves.size();
+  StateInfo st;
+  uint64_t nodes = 0;
+  for (auto &m : moves) {
+    in->MakeMove<Us>(m, &st);
+    nodes += Perft<!Us>(in, depth-1, cache, stop);
+    in->UnmakeMove<Us>(m, st);
+  }
+  if (entry && !(stop && stop->load(memory_order_relaxed))) { entry->key = key; entry->nodes = nodes; }
+  return nodes;
+}
+
+uint64_t Perft(Position *in, bool color, int depth, PerftCache *cache=0, const atomic<bool> *stop=0) {
+  return color ? Perft<BLACK>(in, depth, cache, stop) : Perft<WHITE>(in, depth, cache, stop);
+}
+uint64_t Perft(Position in, bool color, int depth, PerftCache *cache=0) { return Perft(&in, color, depth, cache); }
+
+// The copy-make reference for Perft, walking the vector<Move> from GenerateMoves.
+uint64_t CopyMakePerft(const Position &in, bool color, int depth) {
+  if (depth <= 0) return 1;
   auto moves = GenerateMoves(in, color);
-  sort(moves.begin(), moves.end(), MoveSort);
+  if (depth == 1) return moves.size();
+  uint64_t nodes = 0;
   for (auto &m : moves) {
     Position position = in;
     position.ApplyValidatedMove(m);
-    v = -AlphaBetaNegamaxSearch(position, !color, -beta, -alpha, depth-1).second;
-    if (Max(&best.second, v)) best.first = m;
+    nodes += CopyMakePerft(position, !color, depth-1);
+  }
+  return nodes;
+}
+
+// Parallel perft: subtrees dealt to per-thread deques, with idle threads stealing from the others.
+struct PerftTask {
+  Position position;
+  int ply, root_move;
+};
+
+struct PerftTaskQueue {
+  mutex lock;
+  deque<PerftTask*> tasks;
+};
+
+template <class Count> vector<PerftTask> SplitPerftTasks(const Position &in, bool color, int depth, int threads,
+                                                         MoveList *root_moves, Count count) {
+  vector<PerftTask> tasks{ PerftTask{ in, 0, -1 } }, next;
+  for (int ply = 0; ply < depth && (!ply || int(tasks.size()) < threads * 16); ply++, tasks.swap(next)) {
+    next.clear();
+    for (auto &task : tasks) {
+      MoveList moves;
+      GenerateMoves(task.position, color ^ (ply & 1), ply ? &moves : root_moves);
+      const MoveList &generated = ply ? moves : *root_moves;
+      for (int i = 0, l = generated.size(); i != l; ++i) {
+        int root_move = ply ? task.root_move : i;
+        count(generated[i], ply, root_move);
+        if (ply + 1 >= depth) continue;
+        next.push_back(PerftTask{ task.position, ply + 1, root_move });
+        next.back().position.ApplyValidatedMove(generated[i]);
+      }
+    }
+  }
+  return tasks;
+}
+
+template <class Result, class Run> void RunPerftTasks(vector<PerftTask> *tasks, vector<Result> *results, Run run) {
+  int threads = results->size();
+  vector<PerftTaskQueue> queues(threads);
+  for (int i = 0, l = tasks->size(); i != l; ++i) queues[i % threads].tasks.push_back(&(*tasks)[i]);
+  auto worker = [&](int t) {
+    for (int victim = t, misses = 0; misses < threads; ) {
+      PerftTask *task = nullptr;
+      {
+        lock_guard<mutex> guard(queues[victim].lock);
+        deque<PerftTask*> &q = queues[victim].tasks;
+        if (q.size()) {
+          if (victim == t) { task = q.back();  q.pop_back();  }
+          else             { task = q.front(); q.pop_front(); }
+        }
+      }
+      if (task) { run(task, &(*results)[t]); victim = t; misses = 0; }
+      else      { victim = (victim + 1) % threads; misses++; }
+    }
+  };
+  vector<thread> workers;
+  for (int t = 1; t < threads; t++) workers.emplace_back(worker, t);
+  worker(0);
+  for (auto &w : workers) w.join();
+}
+
+void ParallelFullSearch(const Position &in, bool color, SearchStats *stats, int threads) {
+  struct alignas(64) Result { SearchStats::Total total; vector<SearchStats::Total> depth_total, divide; };
+  if (stats->max_depth <= 0) return;
+  MoveList root_moves;
+  vector<SearchStats::Total*> root_divide;
+  auto count = [&](Move m, int ply, int root_move) {
+    if (!ply && stats->divide_total) root_divide.push_back
+      (&(*stats->divide_total)[GetMove(GetMovePieceType(m), GetMoveFromSquare(m), GetMoveToSquare(m), 0, 0, 0)]);
+    stats->CountMove(m, ply, stats->divide_total ? root_divide[root_move] : nullptr);
+  };
+  vector<PerftTask> tasks = SplitPerftTasks(in, color, stats->max_depth, threads, &root_moves, count);
+  vector<Result> results(max(1, threads));
+  if (stats->divide_total) for (auto &result : results) result.divide.resize(root_moves.size());
+  RunPerftTasks(&tasks, &results, [&](PerftTask *task, Result *result) {
+    SearchStats thread_stats(&result->total, stats->depth_total ? &result->depth_total : nullptr);
+    thread_stats.max_depth = stats->max_depth;
+    FullSearch(&task->position, color ^ (task->ply & 1), &thread_stats, task->ply,
+               stats->divide_total ? &result->divide[task->root_move] : nullptr);
+  });
+  for (auto &result : results) {
+    if (stats->total) stats->total->Add(result.total);
+    for (int i = 0, l = result.depth_total.size(); i != l; ++i) VectorEnsureElement(*stats->depth_total, i)->Add(result.depth_total[i]);
+    for (int i = 0, l = result.divide.size(); i != l; ++i) root_divide[i]->Add(result.divide[i]);
+  }
+}
+
+uint64_t ParallelPerft(const Position &in, bool color, int depth, int threads, vector<pair<Move, uint64_t>> *divide=0,
+                       const atomic<bool> *stop=0) {
+  struct alignas(64) Result { uint64_t nodes=0; vector<uint64_t> divide; };
+  if (depth <= 0) return 1;
+  MoveList root_moves;
+  Result leaves;
+  auto count = [&](Move, int ply, int root_move) {
+    if (!ply) leaves.divide.push_back(0);
+    if (ply + 1 == depth) { leaves.nodes++; leaves.divide[root_move]++; }
+  };
+  vector<PerftTask> tasks = SplitPerftTasks(in, color, depth, threads, &root_moves, count);
+  vector<Result> results(max(1, threads));
+  for (auto &result : results) result.divide.resize(root_moves.size());
+  RunPerftTasks(&tasks, &results, [&](PerftTask *task, Result *result) {
+    uint64_t nodes = Perft(&task->position, color ^ (task->ply & 1), depth - task->ply, nullptr, stop);
+    result->nodes += nodes;
+    result->divide[task->root_move] += nodes;
+  });
+  for (auto &result : results) {
+    leaves.nodes += result.nodes;
+    for (int i = 0, l = result.divide.size(); i != l; ++i) leaves.divide[i] += result.divide[i];
+  }
+  if (divide) {
+    divide->clear();
+    for (int i = 0, l = root_moves.size(); i != l; ++i) divide->emplace_back(root_moves[i], leaves.divide[i]);
+  }
+  return leaves.nodes;
+}
+
+// Lock-free search results keyed by Position::hash, with key ^ data stored to catch torn entries.
+struct TranspositionTable {
+  enum { Exact=1, LowerBound=2, UpperBound=3 };
+  enum { default_megabytes=16 };
+  struct Result { Move move=0; float score=0; int depth=0, bound=0; };
+  struct Entry { atomic<uint64_t> check{0}, data{0}; };
+  struct alignas(64) Bucket { Entry entry[4]; };
+  vector<Bucket> table;
+  uint8_t generation=0;
+  TranspositionTable(int megabytes=default_megabytes) { Resize(megabytes); }
+
+  void Resize(int megabytes) {
+    size_t buckets = 1, bytes = size_t(max(1, megabytes)) << 20;
+    while (buckets * 2 * sizeof(Bucket) <= bytes) buckets *= 2;
+    table = vector<Bucket>(buckets);
+    generation = 0;
+  }
+
+  void Clear() {
+    for (auto &b : table) for (auto &e : b.entry) { e.check.store(0, memory_order_relaxed); e.data.store(0, memory_order_relaxed); }
+    generation = 0;
+  }
+
+  void NewSearch() { generation++; }
+  Bucket *GetBucket(ZobristHasher::Hash key) { return &table[key & (table.size() - 1)]; }
+  const Bucket *GetBucket(ZobristHasher::Hash key) const { return &table[key & (table.size() - 1)]; }
+  void Prefetch(ZobristHasher::Hash key) const {
+#if defined(__GNUC__) || defined(__clang__)
+    __builtin_prefetch(GetBucket(key));
+#endif
+  }
+
+  // Mate scores are stored relative to the entry's position rather than the search root.
+  static float ScoreToTable  (float score, int ply) { return IsMateScore(score) ? score + (score > 0 ? ply : -ply) : score; }
+  static float ScoreFromTable(float score, int ply) { return IsMateScore(score) ? score - (score > 0 ? ply : -ply) : score; }
+
+  bool Probe(ZobristHasher::Hash key, Result *out, int ply=0) const {
+    for (auto &e : GetBucket(key)->entry) {
+      uint64_t data = e.data.load(memory_order_relaxed);
+      if ((e.check.load(memory_order_relaxed) ^ data) != key || !data) continue;
+      *out = Unpack(data);
+      out->score = ScoreFromTable(out->score, ply);
+      return true;
+    }
+    return false;
+  }
+
+  void Store(ZobristHasher::Hash key, Move move, float score, int depth, int bound, int ply=0) {
+    Entry *replace = nullptr;
+    int replace_value = INT_MAX;
+    for (auto &e : GetBucket(key)->entry) {
+      uint64_t data = e.data.load(memory_order_relaxed);
+      if ((e.check.load(memory_order_relaxed) ^ data) == key && data) {
+        Result old = Unpack(data);
+        if (bound != Exact && old.depth > depth && GetGeneration(data) == generation) return;
+        if (!move) move = old.move;
+        replace = &e;
+        break;
+      }
+      int value = data ? (GetDepth(data) - 8 * uint8_t(generation - GetGeneration(data))) : INT_MIN;
+      if (value < replace_value) { replace_value = value; replace = &e; }
+    }
+    uint64_t data = Pack(move, ScoreToTable(score, ply), depth, bound, generation);
+    replace->data.store(data, memory_order_relaxed);
+    replace->check.store(key ^ data, memory_order_relaxed);
+  }
+
+  // data bits: move>>6 0-25, depth 26-33, bound 34-35, generation 36-43, score in tenths 44-63.
+  static constexpr float max_score = ((1 << 19) - 1) / 10.0f;
+  static uint64_t Pack(Move move, float score, int depth, int bound, uint8_t generation) {
+    int64_t tenths = llroundf(max(-max_score, min(max_score, score)) * 10);
+    return uint64_t(move >> 6) | (uint64_t(max(0, min(255, depth))) << 26) | (uint64_t(bound & 3) << 34) |
+      (uint64_t(generation) << 36) | (uint64_t(tenths) << 44);
+  }
+  static Result Unpack(uint64_t data) {
+    Result ret;
+    ret.move = Move(data & 0x3ffffff) << 6;
+    ret.depth = GetDepth(data);
+    ret.bound = (data >> 34) & 3;
+    ret.score = (int64_t(data) >> 44) / 10.0f;
+    return ret;
+  }
+  static int GetDepth(uint64_t data) { return (data >> 26) & 0xff; }
+  static uint8_t GetGeneration(uint64_t data) { return data >> 36; }
+};
+
+// Quiet move ordering learned from beta cutoffs: killers, counter-moves and butterfly history.
+struct SearchHistory {
+  enum { max_ply=128, history_limit=1<<14 };
+  Move killers[max_ply][2] = {};
+  Move counter_moves[2][END_PIECES][64] = {};
+  int butterfly[2][64][64] = {};
+
+  Move GetCounterMove(bool color, Move previous) const {
+    return previous ? counter_moves[color][GetMovePieceType(previous)][GetMoveToSquare(previous)] : 0;
+  }
+  int GetScore(bool color, Move m) const { return butterfly[color][GetMoveFromSquare(m)][GetMoveToSquare(m)]; }
+
+  void Update(bool color, int ply, Move previous, Move m, int depth, const Move *quiets_tried, int quiets_count) {
+    if (ply < max_ply && !SameMove(killers[ply][0], m)) { killers[ply][1] = killers[ply][0]; killers[ply][0] = m; }
+    if (previous) counter_moves[color][GetMovePieceType(previous)][GetMoveToSquare(previous)] = m;
+    int bonus = min(depth * depth, 400);
+    AddScore(color, m, bonus);
+    for (int i = 0; i != quiets_count; ++i) AddScore(color, quiets_tried[i], -bonus);
+  }
+
+  void AddScore(bool color, Move m, int bonus) {
+    int &score = butterfly[color][GetMoveFromSquare(m)][GetMoveToSquare(m)];
+    score += bonus - score * abs(bonus) / history_limit;
+  }
+};
+
+// Hands out the generated moves best first, selecting the next one lazily on each Next().
+struct MovePicker {
+  enum { TableMove=1<<30, GoodCapture=1<<28, Killer=1<<26, CounterMove=(1<<26)-2, BadCapture=-(1<<28) };
+  MoveList moves;
+  int score[MoveList::Size], next=0;
+
+  template <int Us> void Generate(const Position &in, int type, Move table_move, const SearchHistory *history, int ply) {
+    GenerateMovesOfType<Us>(in, type, ~0ULL, &moves);
+    BitBoard defended = in.AllAttacks(!Us);
+    Move counter_move = history ? history->GetCounterMove(Us, in.move) : 0;
+    for (int i = 0, l = moves.size(); i != l; ++i) {
+      Move m = moves[i];
+      uint8_t piece_type = GetMovePieceType(m), captured = GetMoveCapture(m), promotion = GetMovePromotion(m);
+      if      (table_move && SameMove(m, table_move)) score[i] = TableMove;
+      else if (promotion && promotion != QUEEN)       score[i] = BadCapture - 64 + promotion;
+      else if (captured || promotion) {
+        bool losing = !promotion && piece_weight[piece_type] > piece_weight[captured] &&
+          (defended & SquareMask(GetMoveToSquare(m)));
+        score[i] = (losing ? BadCapture : GoodCapture) + 8 * (captured + promotion) - piece_type;
+      }
+      else if (!history) score[i] = 0;
+      else if (ply < SearchHistory::max_ply && SameMove(m, history->killers[ply][0])) score[i] = Killer;
+      else if (ply < SearchHistory::max_ply && SameMove(m, history->killers[ply][1])) score[i] = Killer - 1;
+      else if (counter_move && SameMove(m, counter_move)) score[i] = CounterMove;
+      else score[i] = history->GetScore(Us, m);
+    }
+  }
+
+  // The previous ordering: MoveSort's raw Move comparison, with the table move first.
+  template <int Us> void GenerateSorted(const Position &in, int type, Move table_move) {
+    GenerateMovesOfType<Us>(in, type, ~0ULL, &moves);
+    sort(moves.begin(), moves.end(), MoveSort);
+    for (int i = 0, l = moves.size(); i != l; ++i) score[i] = (table_move && SameMove(moves[i], table_move)) ? TableMove : -i;
+  }
+
+  Move Next() {
+    if (next == moves.size()) return 0;
+    int best = next;
+    for (int i = next + 1, l = moves.size(); i < l; ++i) if (score[i] > score[best]) best = i;
+    swap(moves[next], moves[best]);
+    swap(score[next], score[best]);
+    return moves[next++];
+  }
+};
+
+// What one search shares down the tree: the transposition table, the node count and the clock.
+struct SearchControl {
+  enum { check_interval=1024 };
+  TranspositionTable *tt=0;
+  const atomic<bool> *stop=0;
+  uint64_t nodes=0, max_nodes=0;
+  Time start=Now(), hard_limit=Time(0);
+  bool stopped=false, quiescence=true, quiescence_evasions=true, move_ordering=true;
+  uint64_t cutoffs=0, first_move_cutoffs=0;
+  SearchHistory history;
+  SearchControl(TranspositionTable *t=0) : tt(t) {}
+
+  Time Elapsed() const { return Now() - start; }
+  bool CountNode() {
+    ++nodes;
+    if ((stop && stop->load(memory_order_relaxed)) || (max_nodes && nodes > max_nodes) ||
+        (!(nodes % check_interval) && hard_limit.count() && Elapsed() >= hard_limit)) stopped = true;
+    return stopped;
+  }
+};
+
+// StaticEvaluation from the side to move's view, with a mate found there scored by its ply.
+template <int Us> float LeafEvaluation(const Position &in, int ply) {
+  float score = StaticEvaluation(in) * (Us == BLACK ? -1 : 1);
+  return score <= -mate_score ? MatedScore(ply) : score;
+}
+
+// Resolves captures and queen promotions past the horizon; ply counts from the root, quiescence_ply from the horizon.
+template <int Us> float QuiescenceSearch(Position *in, float alpha, float beta, SearchControl *control=0, int ply=0,
+                                         int quiescence_ply=0) {
+  static const float delta_margin = 2;
+  static const int max_evasion_ply = 4;
+  if (control && control->CountNode()) return 0;
+  bool evasions = (!control || control->quiescence_evasions) && quiescence_ply < max_evasion_ply && in->Checkers<Us>();
+  float stand_pat = evasions ? -INFINITY : LeafEvaluation<Us>(*in, ply), best = stand_pat, v;
+  if (best >= beta) return best;
+  alpha = max(alpha, best);
+  StateInfo st;
+  MovePicker picker;
+  if (!control || control->move_ordering)
+    picker.Generate<Us>(*in, evasions ? MoveGenType::Evasions : MoveGenType::Captures, 0, nullptr, 0);
+  else picker.GenerateSorted<Us>(*in, evasions ? MoveGenType::Evasions : MoveGenType::Captures, 0);
+  if (evasions && picker.moves.empty()) return MatedScore(ply);
+  for (Move m = picker.Next(); m; m = picker.Next()) {
+    uint8_t promotion = GetMovePromotion(m);
+    if (promotion && promotion != QUEEN) continue;
+    if (!evasions && !(m & MoveFlag::Check) && stand_pat + piece_weight[GetMoveCapture(m)] + delta_margin +
+        (promotion ? piece_weight[QUEEN] - piece_weight[PAWN] : 0) <= alpha) continue;
+    in->MakeMove<Us>(m, &st);
+    v = -QuiescenceSearch<!Us>(in, -beta, -alpha, control, ply+1, quiescence_ply+1);
+    in->UnmakeMove<Us>(m, st);
+    if (control && control->stopped) return best;
+    best = max(best, v);
     if ((alpha = max(alpha, v)) >= beta) break;
   }
   return best;
 }
 
+template <int Us> pair<Move, float> AlphaBetaNegamaxSearch(Position *in, float alpha, float beta, int depth,
+                                                          SearchControl *control=0, int ply=0) {
+  if (!depth && (!control || control->quiescence)) return make_pair(in->move, QuiescenceSearch<Us>(in, alpha, beta, control, ply));
+  if (control && control->CountNode()) return make_pair(0, 0);
+  if (!depth) return make_pair(in->move, LeafEvaluation<Us>(*in, ply));
+  TranspositionTable *tt = control ? control->tt : nullptr;
+  float v, alpha_in = alpha;
+  StateInfo st;
+  pair<Move, float> best(0, -INFINITY);
+  TranspositionTable::Result hit;
+  if (tt && tt->Probe(in->hash, &hit, ply) && hit.move) {
+    if (!in->IsPseudoLegal<Us>(hit.move) || !in->IsLegal<Us>(hit.move)) hit.move = 0;
+    else if (hit.depth >= depth && (hit.bound == TranspositionTable::Exact ||
+                                    (hit.bound == TranspositionTable::LowerBound && hit.score >= beta) ||
+                                    (hit.bound == TranspositionTable::UpperBound && hit.score <= alpha)))
+      return make_pair(hit.move, hit.score);
+  }
+  MovePicker picker;
+  Move quiets_tried[MoveList::Size];
+  int quiets_count = 0, move_count = 0;
+  if (!control || control->move_ordering) picker.Generate<Us>(*in, MoveGenType::All, hit.move, control ? &control->history : nullptr, ply);
+  else                                    picker.GenerateSorted<Us>(*in, MoveGenType::All, hit.move);
+  for (Move m = picker.Next(); m; m = picker.Next()) {
+    bool quiet = !GetMoveCapture(m) && !GetMovePromotion(m);
+    move_count++;
+    in->MakeMove<Us>(m, &st);
+    if (tt) tt->Prefetch(in->hash);
+    v = -AlphaBetaNegamaxSearch<!Us>(in, -beta, -alpha, depth-1, control, ply+1).second;
+    in->UnmakeMove<Us>(m, st);
+    if (control && control->stopped) return best;
+    if (Max(&best.second, v)) best.first = m;
+    if ((alpha = max(alpha, v)) >= beta) {
+      if (control) {
+        control->cutoffs++;
+        control->first_move_cutoffs += move_count == 1;
+        if (quiet && control->move_ordering) control->history.Update(Us, ply, in->move, m, depth, quiets_tried, quiets_count);
+      }
+      break;
+    }
+    if (quiet) quiets_tried[quiets_count++] = m;
+  }
+  if (!move_count) best.second = in->Checkers<Us>() ? MatedScore(ply) : 0;
+  if (tt && best.first) tt->Store(in->hash, best.first, best.second, depth, best.second <= alpha_in ?
+                                  TranspositionTable::UpperBound : (best.second >= beta ? TranspositionTable::LowerBound :
+                                                                    TranspositionTable::Exact), ply);
+  return best;
+}
+
+pair<Move, float> AlphaBetaNegamaxSearch(Position *in, bool color, float alpha, float beta, int depth,
+                                         SearchControl *control=0) {
+  return color ? AlphaBetaNegamaxSearch<BLACK>(in, alpha, beta, depth, control) : AlphaBetaNegamaxSearch<WHITE>(in, alpha, beta, depth, control);
+}
+
+pair<Move, float> AlphaBetaNegamaxSearch(Position in, bool color, float alpha, float beta, int depth,
+                                         SearchControl *control=0) {
+  return AlphaBetaNegamaxSearch(&in, color, alpha, beta, depth, control);
+}
+
+// The limits of a UCI "go" command, stopping at default_depth when none is given.
+struct SearchLimits {
+  enum { default_depth=6, max_depth=64, default_moves_to_go=30 };
+  static constexpr Time move_overhead = Time(30);
+  Time time[2] = { Time(0), Time(0) }, increment[2] = { Time(0), Time(0) }, movetime = Time(0);
+  int moves_to_go = 0, depth = 0;
+  uint64_t nodes = 0;
+  bool infinite = false;
+
+  static SearchLimits FromUCI(const string &go) {
+    SearchLimits ret;
+    StringWordIter words(go);
+    for (string word = words.NextString(); word.size(); word = words.NextString()) {
+      if      (word == "infinite")  ret.infinite = true;
+      else if (word == "wtime")     ret.time[WHITE]      = Time(atoll(words.NextString().c_str()));
+      else if (word == "btime")     ret.time[BLACK]      = Time(atoll(words.NextString().c_str()));
+      else if (word == "winc")      ret.increment[WHITE] = Time(atoll(words.NextString().c_str()));
+      else if (word == "binc")      ret.increment[BLACK] = Time(atoll(words.NextString().c_str()));
+      else if (word == "movetime")  ret.movetime         = Time(atoll(words.NextString().c_str()));
+      else if (word == "movestogo") ret.moves_to_go      = atoi(words.NextString());
+      else if (word == "depth")     ret.depth            = atoi(words.NextString());
+      else if (word == "nodes")     ret.nodes            = strtoull(words.NextString().c_str(), nullptr, 10);
+    }
+    return ret;
+  }
+
+  bool Timed(bool color) const { return !infinite && (movetime.count() > 0 || time[color].count() > 0); }
+  int MaxDepth() const {
+    return depth > 0 ? min(depth, int(max_depth)) : ((infinite || nodes || time[WHITE].count() > 0 ||
+                                                      time[BLACK].count() > 0 || movetime.count() > 0) ? max_depth : default_depth);
+  }
+
+  // No iteration starts past the soft limit, and the hard limit aborts the one running.
+  void GetTimeLimits(bool color, Time *soft, Time *hard) const {
+    if (movetime.count() > 0) { *soft = *hard = max(Time(1), movetime - move_overhead); return; }
+    Time left = max(Time(1), time[color] - move_overhead);
+    int moves = moves_to_go > 0 ? min(moves_to_go, 50) : default_moves_to_go;
+    Time target = left / moves + increment[color] * 3 / 4;
+    *hard = max(Time(1), min(target * 3, left / (moves > 1 ? 3 : 2)));
+    *soft = min(*hard, target / 2);
+  }
+};
+
+// Searches depth 1, 2, ... and returns the last completed iteration's best move, else any legal move.
+pair<Move, float> IterativeDeepeningSearch(Position in, const SearchLimits &limits, SearchControl *control,
+                                           function<void(int, const pair<Move, float>&)> iteration_cb=nullptr) {
+  bool color = in.flags.to_move_color;
+  Time soft_limit(0), hard_limit(0);
+  if (limits.Timed(color)) limits.GetTimeLimits(color, &soft_limit, &hard_limit);
+  pair<Move, float> best(0, 0);
+  control->max_nodes = limits.nodes;
+  control->hard_limit = hard_limit;
+  for (int depth = 1, max_depth = limits.MaxDepth(); depth <= max_depth; depth++) {
+    auto result = AlphaBetaNegamaxSearch(&in, color, -INFINITY, INFINITY, depth, control);
+    if (control->stopped || !result.first) break;
+    best = result;
+    if (iteration_cb) iteration_cb(depth, best);
+    if (soft_limit.count() && control->Elapsed() >= soft_limit) break;
+  }
+  if (!best.first) {
+    MoveList moves;
+    GenerateMoves(in, color, &moves);
+    if (moves.size()) best.first = moves[0];
+  }
+  return best;
+}
+
 struct GamePosition : public Position {
   string name;
   BitBoard white_attacks[7], black_attacks[7];
@@ -846,32 +1880,117 @@ struct Game {
   }
 };
 
+// "cp" in centipawns, or "mate" in moves, negative when the side to move is the one mated.
+inline string GetUCIScore(float score) {
+  if (!IsMateScore(score)) return StrCat("cp ", int(lrintf(score * 100)));
+  int plies = MateDistance(score);
+  return StrCat("mate ", score > 0 ? (plies + 1) / 2 : -(plies / 2));
+}
+
+// UCI front end; go and go perft run on search_thread while LineCB keeps reading input.
 struct Engine {
   Game game;
+  TranspositionTable tt;
   StringCB write_cb;
+  mutex write_lock, search_lock;
+  condition_variable search_cv;
+  atomic<bool> stop_search{false};
+  thread search_thread;
+  bool search_infinite=false, quit=false;
   Engine(StringCB w_cb) : write_cb(move(w_cb)) {}
+  ~Engine() { StopSearch(); }
+
+  void Write(const string &text) {
+    lock_guard<mutex> lock(write_lock);
+    write_cb(text);
+  }
 
   void LineCB(const string &text) {
-    if      (text == "uci")        write_cb("uciok\n");
-    else if (text == "isready")    write_cb("readyok\n");
-    else if (text == "ucinewgame") game = Game();
-    else if (PrefixMatch(text, "position ")) {
+    if      (text == "uci")        Write(StrCat("option name Hash type spin default ", TranspositionTable::default_megabytes,
+                                                " min 1 max 65536\nuciok\n"));
+    else if (text == "isready")    Write("readyok\n");
+    else if (text == "stop")       StopSearch();
+    else if (text == "quit")       { StopSearch(); quit = true; }
+    else if (text == "ucinewgame") { StopSearch(); game = Game(); tt.Clear(); }
+    else if (PrefixMatch(text, "setoption name ")) {
+      string name = text.substr(15), value;
+      size_t value_offset = name.find(" value ");
+      if (value_offset != string::npos) { value = name.substr(value_offset + 7); name.resize(value_offset); }
+      StopSearch();
+      if (name == "Hash") tt.Resize(atoi(value));
+      else ERROR("unknown option '", name, "'");
+    } else if (PrefixMatch(text, "position ")) {
       StringWordIter words(StringPiece::FromRemaining(text, 9));
       string type = words.NextString();
-      if (type == "print") write_cb(StrCat(game.position.GetFEN(), "\n"));
+      if (type == "print") Write(StrCat(game.position.GetFEN(), "\n"));
       else if (type == "fen" && words.Next()) {
         string fen = text.substr(9 + words.CurrentOffset());
         if (!game.position.LoadFEN(fen)) ERROR("Load FEN '", fen, "'");
       } else if (type == "startpos") {
         game.position.Reset();
       } else ERROR("unknown position type '", type, "'");
+    } else if (PrefixMatch(text, "go perft ")) {
+      StartPerft(atoi(text.substr(9)));
     } else if (text == "go" || PrefixMatch(text, "go ")) {
-      auto move = AlphaBetaNegamaxSearch(game.position, game.position.flags.to_move_color,
-                                         -INFINITY, INFINITY, 6);
-      string text = GetLongMoveName(move.first);
-      INFO("bestmove ", text, " ", move.second);
-      write_cb(StrCat("bestmove ", text, "\n"));
+      StartSearch(SearchLimits::FromUCI(text.substr(2)));
+    }
+  }
+
+  void StartSearch(const SearchLimits &limits) {
+    StopSearch();
+    stop_search = false;
+    search_infinite = limits.infinite;
+    tt.NewSearch();
+    search_thread = thread(&Engine::RunSearch, this, Position(game.position), limits);
+  }
+
+  void StartPerft(int depth) {
+    StopSearch();
+    stop_search = false;
+    search_infinite = false;
+    search_thread = thread(&Engine::RunPerft, this, Position(game.position), depth);
+  }
+
+  void StopSearch() {
+    if (!search_thread.joinable()) return;
+    { lock_guard<mutex> lock(search_lock); stop_search = true; }
+    search_cv.notify_all();
+    search_thread.join();
+  }
+
+  // Lets a bounded search finish, e.g. at the end of piped input.
+  void WaitForSearch() {
+    if (search_infinite) StopSearch();
+    else if (search_thread.joinable()) search_thread.join();
+  }
+
+  // A stopped perft prints nothing, since its counts are incomplete.
+  void RunPerft(Position position, int depth) {
+    vector<pair<Move, uint64_t>> divide;
+    uint64_t nodes = ParallelPerft(position, position.flags.to_move_color, depth,
+                                   max(1u, thread::hardware_concurrency()), &divide, &stop_search);
+    if (stop_search) return;
+    string text;
+    for (auto &d : divide) StrAppend(&text, GetUCIMoveName(d.first), ": ", d.second, "\n");
+    Write(StrCat(text, "\nNodes searched: ", nodes, "\n"));
+  }
+
+  void RunSearch(Position position, SearchLimits limits) {
+    SearchControl control(&tt);
+    control.stop = &stop_search;
+    auto move = IterativeDeepeningSearch(position, limits, &control, [&](int depth, const pair<Move, float> &best) {
+      int64_t ms = control.Elapsed().count();
+      Write(StrCat("info depth ", depth, " score ", GetUCIScore(best.second), " nodes ", control.nodes,
+                   " time ", ms, " nps ", control.nodes * 1000 / max<int64_t>(1, ms), " pv ",
+                   GetUCIMoveName(best.first), "\n"));
+    });
+    if (limits.infinite) {
+      unique_lock<mutex> lock(search_lock);
+      search_cv.wait(lock, [&](){ return stop_search.load(); });
     }
+    string text = move.first ? GetUCIMoveName(move.first) : "0000";
+    INFO("bestmove ", text, " ", move.second);
+    Write(StrCat("bestmove ", text, "\n"));
   }
 };
 
@@ -910,7 +2029,7 @@ struct UniversalChessInterfaceEngine {
     result_cb.emplace_back(move(callback));
     // string position = StrCat("startpos moves ", game->LongAlgebraicMoveList());
     string position = StrCat("fen ", game->position.GetFEN());
-    CHECK(Write(StrCat("ucinewgame\nposition ", position, "\ngo movetime ", movesecs, "\n")));
+    CHECK(Write(StrCat("ucinewgame\nposition ", position, "\ngo", movesecs ? StrCat(" movetime ", movesecs * 1000) : "", "\n")));
   }
 
   bool Write(const string &s) {
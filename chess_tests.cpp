@@ -214,6 +214,77 @@ TEST(AttackMaskTest, BlackPawn) {
   }
 }
 
+template <class X> int SliderAttackMismatches(const X &sliders) {
+  int mismatches = 0;
+  for (int p=0; p<64; p++) {
+    vector<BitBoard> rook_variation, bishop_variation;
+    MagicMoves::GetRookOccupancyVariations(p, &rook_variation);
+    MagicMoves::GetBishopOccupancyVariations(p, &bishop_variation);
+    for (auto o : rook_variation) {
+      BitBoard occupied = o | (Rand64() & ~rook_occupancy_mask[p]);
+      if (sliders.RookAttacks(p, occupied) != MagicMoves::RookAttacksSlow(p, occupied)) mismatches++;
+    }
+    for (auto o : bishop_variation) {
+      BitBoard occupied = o | (Rand64() & ~bishop_occupancy_mask[p]);
+      if (sliders.BishopAttacks(p, occupied) != MagicMoves::BishopAttacksSlow(p, occupied)) mismatches++;
+    }
+  }
+  return mismatches;
+}
+
+TEST(SliderAttackTest, Magic) {
+  auto sliders = make_unique<MagicMoves>();
+  EXPECT_EQ(0, SliderAttackMismatches(*sliders));
+}
+
+#ifdef __BMI2__
+TEST(SliderAttackTest, Pext) {
+  auto sliders = make_unique<PextMoves>();
+  EXPECT_EQ(0, SliderAttackMismatches(*sliders));
+}
+#endif
+
+TEST(SliderAttackTest, Hyperbola) {
+  auto sliders = make_unique<HyperbolaMoves>();
+  EXPECT_EQ(0, SliderAttackMismatches(*sliders));
+}
+
+#ifdef CHESS_AVX2_ATTACKS
+int AllAttacksMismatches(const Position &position) {
+  int mismatches = 0;
+  for (int color = WHITE; color <= BLACK; color++)
+    mismatches += position.ComputeAllAttacksAVX2(color) != position.ComputeAllAttacksScalar(color);
+  return mismatches;
+}
+
+TEST(AllAttacksTest, AVX2) {
+  if (!cpu_has_avx2) return;
+  unique_ptr<File> testfile(app->OpenFile("perftsuite.epd"));
+  if (!testfile || !testfile->Opened()) { EXPECT_TRUE(false); return; }
+  FileLineIter tests(testfile.get());
+  vector<string> arg;
+  int positions = 0, mismatches = 0;
+  for (const char *line = tests.Next(); line; line = tests.Next()) {
+    Split(StringPiece(line, tests.CurrentLength()), isint<';'>, nullptr, &arg);
+    Position position;
+    if (arg.size() < 1 || !position.LoadFEN(arg[0])) { EXPECT_TRUE(false); continue; }
+    mismatches += AllAttacksMismatches(position);
+    for (int playout = 0; playout < 20; playout++) {
+      Position game = position;
+      MoveList moves;
+      for (int ply = 0; ply < 100; ply++, positions++) {
+        mismatches += AllAttacksMismatches(game);
+        GenerateMoves(game, game.flags.to_move_color, &moves);
+        if (moves.empty()) break;
+        game.ApplyValidatedMove(moves[Rand64() % moves.size()]);
+      }
+    }
+  }
+  EXPECT_LT(100000, positions);
+  EXPECT_EQ(0, mismatches);
+}
+#endif
+
 TEST(BoardTest, ByteBoard) {
   for (int i=0; i<64; i++) {
     EXPECT_EQ(  rook_occupancy_mask[i], BitBoardFromString(BitBoardToString(  rook_occupancy_mask[i]).c_str()));
@@ -362,8 +433,7 @@ TEST(MoveTest, Sorting) {
 
 TEST(MoveTest, Hashing) {
   Position position;
-  static const vector<ZobristHasher::Hash> &zobrist = Singleton<ZobristHasher>::Get()->data;
-  EXPECT_EQ(Singleton<ZobristHasher>::Get()->initial_position_hash, position.hash);
+  EXPECT_EQ(zobrist_hasher.initial_position_hash, position.hash);
   position.ApplyValidatedMove(GetMove(PAWN, e2, e4, 0, 0, MoveFlag::DoubleStepPawn));
   EXPECT_EQ(Position("rnbqkbnr/pppppppp/8/8/4P3/8/PPPP1PPP/RNBQKBNR b KQkq - 0 1").hash, position.hash);
   position.ApplyValidatedMove(GetMove(PAWN, e7, e5, 0, 0, MoveFlag::DoubleStepPawn));
@@ -389,7 +459,9 @@ TEST(MoveTest, Hashing) {
   position.ApplyValidatedMove(GetMove(PAWN, c5, c4, 0, 0, 0));
   EXPECT_EQ(Position("r1bqkbnr/1pp2ppp/p7/4N3/2p1P3/8/PPPP1PPP/RNBQ1RK1 w kq - 0 6").hash, position.hash);
   position.ApplyValidatedMove(GetMove(PAWN, d2, d4, 0, 0, MoveFlag::DoubleStepPawn));
-  EXPECT_EQ(Position("r1bqkbnr/1pp2ppp/p7/4N3/2pPP3/8/PPP2PPP/RNBQ1RK1 b kq - 0 7").hash, position.hash);
+  EXPECT_EQ(Position("r1bqkbnr/1pp2ppp/p7/4N3/2pPP3/8/PPP2PPP/RNBQ1RK1 b kq d3 0 7").hash, position.hash);
+  EXPECT_NE(Position("r1bqkbnr/1pp2ppp/p7/4N3/2pPP3/8/PPP2PPP/RNBQ1RK1 b kq - 0 7").hash, position.hash);
+  EXPECT_EQ("r1bqkbnr/1pp2ppp/p7/4N3/2pPP3/8/PPP2PPP/RNBQ1RK1 b kq d3 0 7", position.GetFEN());
   position.ApplyValidatedMove(GetMove(PAWN, c4, d3, PAWN, 0, MoveFlag::EnPassant));
   EXPECT_EQ(Position("r1bqkbnr/1pp2ppp/p7/4N3/4P3/3p4/PPP2PPP/RNBQ1RK1 w kq - 0 7").hash, position.hash);
   position.ApplyValidatedMove(GetMove(KNIGHT, e5, f7, PAWN, 0, 0));
@@ -404,6 +476,158 @@ TEST(MoveTest, Hashing) {
   EXPECT_EQ(Position("r1bQ1bnr/1pp2kpp/p7/4P3/8/8/PPp2PPP/RNB2RK1 b - - 0 10").hash, position.hash);
   position.ApplyValidatedMove(GetMove(PAWN, c2, b1, KNIGHT, QUEEN, 0));
   EXPECT_EQ(Position("r1bQ1bnr/1pp2kpp/p7/4P3/8/8/PP3PPP/RqB2RK1 w - - 0 10").hash, position.hash);
+  EXPECT_EQ(Position("r1bQ1bnr/1pp2kpp/p7/4P3/8/8/PP3PPP/RqB2RK1 w - - 0 10").pawn_hash, position.pawn_hash);
+  EXPECT_EQ(Position("r1bQ1bnr/1pp2kpp/p7/4P3/8/8/PP3PPP/RqB2RK1 w - - 0 10").material_hash, position.material_hash);
+
+  Position initial;
+  EXPECT_EQ(zobrist_hasher.GetPawnHash(initial), initial.pawn_hash);
+  EXPECT_EQ(zobrist_hasher.GetMaterialHash(initial), initial.material_hash);
+  EXPECT_NE(initial.material_hash, position.material_hash);
+  EXPECT_EQ(Position("4k3/8/8/8/8/8/8/RN2K3 w - - 0 1").material_hash, Position("1N2k3/8/8/8/8/8/8/4K2R b - - 0 1").material_hash);
+  EXPECT_NE(Position("4k3/8/8/8/8/8/8/RN2K3 w - - 0 1").material_hash, Position("4k3/8/8/8/8/8/8/RB2K3 w - - 0 1").material_hash);
+  EXPECT_EQ(Position("4k3/p7/8/8/8/8/P7/RN2K3 w - - 0 1").pawn_hash, Position("4k3/p7/8/8/8/8/P7/4K2R b - - 0 1").pawn_hash);
+}
+
+int BoardMismatches(const Position &position) {
+  int mismatches = 0;
+  for (int s=0; s<64; s++) if (position.board[s] != position.ScanSquare(s)) mismatches++;
+  return mismatches;
+}
+
+// Plays out every line of legal moves depth plies deep, summing mismatches() over each position
+// reached, the root included with played=0.  Every UnmakeMove must also restore the position,
+// its keys, mailbox and attack maps exactly, or that counts as a mismatch too.
+int TreeMismatches(Position *position, int depth, const function<int(const Position&, Move played)> &mismatches,
+                   Move played=0) {
+  int ret = mismatches(*position, played);
+  if (depth <= 0) return ret;
+  StateInfo st;
+  MoveList moves;
+  GenerateMoves(*position, position->flags.to_move_color, &moves);
+  for (auto &m : moves) {
+    Position expect = *position;
+    position->MakeMove(m, &st);
+    ret += TreeMismatches(position, depth-1, mismatches, m);
+    position->UnmakeMove(m, st);
+    if (!(expect == *position) || memcmp(expect.board, position->board, sizeof(expect.board)) ||
+        expect.hash != position->hash || expect.pawn_hash != position->pawn_hash ||
+        expect.material_hash != position->material_hash ||
+        expect.AllAttacks(WHITE) != position->AllAttacks(WHITE) ||
+        expect.AllAttacks(BLACK) != position->AllAttacks(BLACK)) ret++;
+  }
+  return ret;
+}
+
+int MakeUnmakeMismatches(const Position &position, Move) {
+  int mismatches = BoardMismatches(position);
+  for (int color = WHITE; color <= BLACK; color++)
+    if (position.AllAttacks(color) != position.ComputeAllAttacks(color)) mismatches++;
+  if (position.hash          != zobrist_hasher.GetHash(position, position.flags, position.EnPassantFile()) ||
+      position.pawn_hash     != zobrist_hasher.GetPawnHash(position) ||
+      position.material_hash != zobrist_hasher.GetMaterialHash(position)) mismatches++;
+  return mismatches;
+}
+
+TEST(MoveTest, MakeUnmake) {
+  Position position;
+  EXPECT_EQ(0, TreeMismatches(&position, 3, MakeUnmakeMismatches));
+  position = Position::FromByteBoard(kiwipete_byte_board);
+  EXPECT_EQ(0, TreeMismatches(&position, 3, MakeUnmakeMismatches));
+  for (auto fen : { perft_pos3_fen, perft_pos4_fen, perft_pos4_mirror_fen, perft_pos5_fen, perft_pos6_fen }) {
+    EXPECT_EQ(true, position.LoadFEN(fen));
+    EXPECT_EQ(0, TreeMismatches(&position, 3, MakeUnmakeMismatches));
+  }
+}
+
+int StagedGenerationMismatches(const Position &position, Move) {
+  int mismatches = 0;
+  bool color = position.flags.to_move_color;
+  MoveList moves, captures, quiets, evasions;
+  GenerateMoves(position, color, &moves);
+  GenerateCaptures(position, color, &captures);
+  GenerateQuiets(position, color, &quiets);
+  GenerateEvasions(position, color, &evasions);
+  vector<Move> all(moves.begin(), moves.end()), staged(captures.begin(), captures.end());
+  staged.insert(staged.end(), quiets.begin(), quiets.end());
+  sort(all.begin(), all.end());
+  sort(staged.begin(), staged.end());
+  if (all != staged) mismatches++;
+  if (position.Checkers(color)) {
+    vector<Move> evasion(evasions.begin(), evasions.end());
+    sort(evasion.begin(), evasion.end());
+    if (all != evasion) mismatches++;
+  } else if (evasions.size()) mismatches++;
+  for (auto &m : captures) if (!GetMoveCapture(m) && !GetMovePromotion(m)) mismatches++;
+  for (auto &m : quiets)   if ( GetMoveCapture(m) ||  GetMovePromotion(m)) mismatches++;
+  return mismatches;
+}
+
+TEST(MoveTest, StagedGeneration) {
+  Position position;
+  EXPECT_EQ(0, TreeMismatches(&position, 2, StagedGenerationMismatches));
+  position.LoadByteBoard(kiwipete_byte_board);
+  EXPECT_EQ(0, TreeMismatches(&position, 2, StagedGenerationMismatches));
+  for (auto fen : { perft_pos3_fen, perft_pos4_fen, perft_pos4_mirror_fen, perft_pos5_fen, perft_pos6_fen }) {
+    EXPECT_EQ(true, position.LoadFEN(fen));
+    EXPECT_EQ(0, TreeMismatches(&position, 2, StagedGenerationMismatches));
+  }
+
+  MoveList captures;
+  position.LoadByteBoard(kiwipete_byte_board);
+  GenerateCaptures(position, WHITE, &captures, SquareMask(e6));
+  ASSERT_EQ(1, captures.size());
+  EXPECT_EQ("d5e6", GetLongMoveName(captures[0]));
+}
+
+int GivesCheckMismatches(const Position &position, Move played) {
+  return played && bool(played & MoveFlag::Check) != bool(position.Checkers(position.flags.to_move_color));
+}
+
+TEST(MoveTest, GivesCheck) {
+  Position position;
+  EXPECT_EQ(0, TreeMismatches(&position, 4, GivesCheckMismatches));
+  position.LoadByteBoard(kiwipete_byte_board);
+  EXPECT_EQ(0, TreeMismatches(&position, 3, GivesCheckMismatches));
+  for (auto fen : { perft_pos3_fen, perft_pos4_fen, perft_pos4_mirror_fen, perft_pos5_fen, perft_pos6_fen }) {
+    EXPECT_EQ(true, position.LoadFEN(fen));
+    EXPECT_EQ(0, TreeMismatches(&position, 3, GivesCheckMismatches));
+  }
+}
+
+int LegalityMismatches(const Position &position, Move) {
+  int mismatches = 0;
+  bool color = position.flags.to_move_color;
+  MoveList moves;
+  GenerateMoves(position, color, &moves);
+  unordered_set<Move> legal;
+  for (auto &m : moves) {
+    Move move = m & ~MoveFlag::Check;
+    legal.insert(move);
+    if (!position.IsPseudoLegal(move) || !position.IsLegal(move)) mismatches++;
+    if (GetMoveCapture(move) && position.IsPseudoLegal(move ^ (1 << 23))) mismatches++;
+  }
+  for (SquareIter p(position.Pieces(color)[ALL]); p; ++p)
+    for (int s = 0; s < 64; s++) {
+      Move move = position.GetPlayerMove(GetPieceType(position.GetSquare(p.GetSquare())), p.GetSquare(), s);
+      if ((legal.count(move) != 0) != (position.IsPseudoLegal(move) && position.IsLegal(move))) mismatches++;
+    }
+  return mismatches;
+}
+
+TEST(MoveTest, Legality) {
+  Position position;
+  EXPECT_EQ(0, TreeMismatches(&position, 2, LegalityMismatches));
+  position.LoadByteBoard(kiwipete_byte_board);
+  EXPECT_EQ(0, TreeMismatches(&position, 2, LegalityMismatches));
+  for (auto fen : { perft_pos3_fen, perft_pos4_fen, perft_pos4_mirror_fen, perft_pos5_fen, perft_pos6_fen }) {
+    EXPECT_EQ(true, position.LoadFEN(fen));
+    EXPECT_EQ(0, TreeMismatches(&position, 2, LegalityMismatches));
+  }
+  EXPECT_EQ(true, position.LoadFEN("4k3/8/8/8/8/8/4r3/R3K2R w KQ - 0 1"));
+  EXPECT_EQ(false, position.PlayerIllegalMove(KING, e1, d1, position));
+  EXPECT_EQ(true,  position.PlayerIllegalMove(KING, e1, g1, position));
+  EXPECT_EQ(true,  position.PlayerIllegalMove(ROOK, a1, a2, position));
+  EXPECT_EQ(false, position.PlayerIllegalMove(KING, e1, e2, position));
 }
 
 #define CHESS_PERFT_TESTS
@@ -568,10 +792,90 @@ TEST(Perft, Position6) {
   if (auto d = VectorGet(depth_total, 4)) { EXPECT_EQ(164075551, d->nodes); }
 }
 
+TEST(Perft, CopyMake) {
+  Position position = Position::FromByteBoard(kiwipete_byte_board);
+  SearchStats::Total movelist_total;
+  SearchStats movelist_search(&movelist_total);
+  movelist_search.max_depth = 4;
+  FullSearch(position, WHITE, &movelist_search);
+  EXPECT_EQ(4085603 + 97862 + 2039 + 48, movelist_total.nodes);
+  EXPECT_EQ(4085603ULL, CopyMakePerft(position, WHITE, 4));
+  EXPECT_EQ(674624ULL, CopyMakePerft(Position(perft_pos3_fen), WHITE, 5));
+}
+
+TEST(Perft, BulkCount) {
+  vector<SearchStats::Total> depth_total;
+  Position position = Position::FromByteBoard(kiwipete_byte_board);
+  SearchStats search;
+  search.max_depth = 4;
+  search.depth_total = &depth_total;
+  FullSearch(position, WHITE, &search);
+  uint64_t nodes = Perft(position, WHITE, 4);
+
+  EXPECT_EQ(4, depth_total.size());
+  EXPECT_EQ(4085603ULL, nodes);
+  if (auto d = VectorGet(depth_total, 3)) { EXPECT_EQ(d->nodes, nodes); }
+  EXPECT_EQ(1ULL,    Perft(position, WHITE, 0));
+  EXPECT_EQ(48ULL,   Perft(position, WHITE, 1));
+  EXPECT_EQ(2039ULL, Perft(position, WHITE, 2));
+}
+
+TEST(Perft, PerftCache) {
+  Position position = Position::FromByteBoard(kiwipete_byte_board);
+  PerftCache check_cache(16);
+  check_cache.check_hash = true;
+  EXPECT_EQ(4085603ULL, Perft(position, WHITE, 4, &check_cache));
+  EXPECT_EQ(0ULL, check_cache.hash_mismatches);
+  EXPECT_LT(0ULL, check_cache.hits);
+
+  PerftCache cache(20);
+  EXPECT_EQ(193690690ULL, Perft(position, WHITE, 5, &cache));
+  EXPECT_EQ(11030083ULL, Perft(Position(perft_pos3_fen), WHITE, 6, &cache));
+}
+
+TEST(Perft, Parallel) {
+  Position position = Position::FromByteBoard(kiwipete_byte_board);
+  vector<SearchStats::Total> depth_total, parallel_depth_total;
+  unordered_map<Chess::Move, SearchStats::Total> divide_total, parallel_divide_total;
+  SearchStats search, parallel_search;
+  search.max_depth = parallel_search.max_depth = 4;
+  search.depth_total = &depth_total;
+  search.divide_total = &divide_total;
+  parallel_search.depth_total = &parallel_depth_total;
+  parallel_search.divide_total = &parallel_divide_total;
+  FullSearch(position, WHITE, &search);
+  ParallelFullSearch(position, WHITE, &parallel_search, 4);
+
+  EXPECT_EQ(depth_total.size(), parallel_depth_total.size());
+  for (int i = 0, l = min(depth_total.size(), parallel_depth_total.size()); i != l; ++i) {
+    EXPECT_EQ(depth_total[i].nodes,    parallel_depth_total[i].nodes);
+    EXPECT_EQ(depth_total[i].captures, parallel_depth_total[i].captures);
+    EXPECT_EQ(depth_total[i].checks,   parallel_depth_total[i].checks);
+  }
+  EXPECT_EQ(48, parallel_divide_total.size());
+  for (auto &d : divide_total) EXPECT_EQ(d.second.nodes, parallel_divide_total[d.first].nodes);
+
+  vector<pair<Chess::Move, uint64_t>> divide;
+  uint64_t divide_sum = 0;
+  EXPECT_EQ(674624ULL, ParallelPerft(Position(perft_pos3_fen), WHITE, 5, 3, &divide));
+  for (auto &d : divide) divide_sum += d.second;
+  EXPECT_EQ(14, divide.size());
+  EXPECT_EQ(674624ULL, divide_sum);
+  EXPECT_EQ(48ULL, ParallelPerft(position, WHITE, 1, 4));
+  EXPECT_EQ(1ULL,  ParallelPerft(position, WHITE, 0, 4));
+}
+
+TEST(Perft, Mailbox) {
+  Position position = Position::FromByteBoard(kiwipete_byte_board);
+  EXPECT_EQ(0, BoardMismatches(position));
+  for (int s = 0; s < 64; s++) EXPECT_EQ(position.ScanSquare(s), position.GetSquare(s));
+}
+
 TEST(Perft, PerftSuite) {
   unique_ptr<File> testfile(app->OpenFile("perftsuite.epd"));
   if (!testfile || !testfile->Opened()) { EXPECT_TRUE(false); return; }
   FileLineIter tests(testfile.get());
+  const int max_serial_depth = 4;
   vector<SearchStats::Total> depth_total;
   Chess::Position position;
   vector<string> arg;
@@ -580,18 +884,20 @@ TEST(Perft, PerftSuite) {
     Split(StringPiece(line, tests.CurrentLength()), isint<';'>, nullptr, &arg);
     if (arg.size() < 2) { EXPECT_TRUE(false); continue; }
     if (!position.LoadFEN(arg[0])) { EXPECT_TRUE(false); continue; }
-    vector<int> depth;
+    vector<uint64_t> depth;
     for (int i=1, l=arg.size(); i != l; ++i) {
       EXPECT_TRUE(PrefixMatch(arg[i], StrCat("D", i, " ")));
       depth.push_back(LFL::atoi(arg[i].data() + 3));
     }
     INFO("PerftSuite[", ++count, "]: depth=", depth.size(), " ", position.GetFEN());
     SearchStats search;
-    search.max_depth = depth.size();
-    (search.depth_total = &depth_total)->clear();
-    FullSearch(position, position.flags.to_move_color, &search);
-    if (depth.size() != depth_total.size()) { EXPECT_TRUE(false); continue; }
-    for (int i=0, l=depth.size(); i != l; ++i) { EXPECT_EQ(depth[i], depth_total[i].nodes); }
+    if ((search.max_depth = min<int>(depth.size() - 1, max_serial_depth))) {
+      (search.depth_total = &depth_total)->clear();
+      FullSearch(position, position.flags.to_move_color, &search);
+      if (size_t(search.max_depth) != depth_total.size()) { EXPECT_TRUE(false); continue; }
+      for (int i=0, l=depth_total.size(); i != l; ++i) { EXPECT_EQ(depth[i], depth_total[i].nodes); }
+    }
+    EXPECT_EQ(depth.back(), ParallelPerft(position, position.flags.to_move_color, depth.size(), thread::hardware_concurrency()));
   }
 }
 #endif // CHESS_PERFT_TESTS
@@ -658,3 +964,313 @@ TEST(EvaluationTest, Search) {
   EXPECT_GT(move.second, 100);
   EXPECT_EQ("e4f6", GetLongMoveName(move.first));
 }
+
+pair<Move, float> CountedSearch(const string &fen, int depth, bool quiescence, bool evasions, uint64_t *nodes) {
+  Position position(fen);
+  SearchControl control;
+  control.quiescence = quiescence;
+  control.quiescence_evasions = evasions;
+  auto ret = AlphaBetaNegamaxSearch(position, position.flags.to_move_color, -INFINITY, INFINITY, depth, &control);
+  *nodes = control.nodes;
+  return ret;
+}
+
+TEST(EvaluationTest, Quiescence) {
+  uint64_t nodes, plain_nodes;
+
+  // Without quiescence the queen takes a defended pawn at the horizon
+  string hanging_fen = "6k1/8/3p4/4p3/8/8/1Q6/4K3 w - - 0 1";
+  EXPECT_EQ("b2e5", GetLongMoveName(CountedSearch(hanging_fen, 1, false, false, &nodes).first));
+  EXPECT_NE("b2e5", GetLongMoveName(CountedSearch(hanging_fen, 3, false, false, &plain_nodes).first));
+  EXPECT_EQ("b2b8", GetLongMoveName(CountedSearch(hanging_fen, 1, true,  true,  &nodes).first));
+  EXPECT_LT(nodes * 10, plain_nodes);
+
+  // Mate in 2 after Qh3+, seen at depth 3 plain, 2 with captures and 1 with check evasions too
+  string mate_fen = "Q7/ppp2k1p/3p2p1/5b2/4P1nq/2P4P/PP1P1bP1/RNB2R1K b - - 0 40";
+  auto move = CountedSearch(mate_fen, 3, false, false, &plain_nodes);
+  EXPECT_EQ("h4h3", GetLongMoveName(move.first));
+  EXPECT_GT(move.second, 100);
+  move = CountedSearch(mate_fen, 2, true, false, &nodes);
+  EXPECT_EQ("h4h3", GetLongMoveName(move.first));
+  EXPECT_GT(move.second, 100);
+  move = CountedSearch(mate_fen, 1, true, true, &nodes);
+  EXPECT_EQ("h4h3", GetLongMoveName(move.first));
+  EXPECT_GT(move.second, 100);
+  EXPECT_LT(nodes * 5, plain_nodes);
+
+  // The EvaluationTest.Search positions at the same depths, with and without
+  for (auto &c : vector<tuple<string, int, string>>{
+       { "4k3/4P3/3PK3/8/8/8/8/8 w - - 0 40", 1, "d6d7" },
+       { "r1bq1r1k/1pppNppp/p7/4R2Q/n7/8/PPPP1PPP/R1B3K1 w - - 0 40", 3, "h5h7" },
+       { "r4r2/1q3pkp/p1b1p1n1/1p4QP/4P3/1BP3P1/P4P2/R2R2K1 w - - 0 40", 5, "h5h6" },
+       { "r7/2p2pk1/p5p1/1p1Q2Kp/1P6/2P1N2P/1P2n1P1/R5b1 b - - 0 40", 5, "f7f6" } }) {
+    EXPECT_EQ(get<2>(c), GetLongMoveName(CountedSearch(get<0>(c), get<1>(c), false, false, &plain_nodes).first));
+    EXPECT_EQ(get<2>(c), GetLongMoveName(CountedSearch(get<0>(c), get<1>(c), true,  true,  &nodes).first));
+    INFO(get<2>(c), " depth ", get<1>(c), " nodes: plain ", plain_nodes, " quiescence ", nodes);
+  }
+}
+
+TEST(EvaluationTest, TranspositionTable) {
+  TranspositionTable tt(1);
+  EXPECT_EQ(16384, tt.table.size());
+  TranspositionTable::Result hit;
+  Move m = GetMove(PAWN, e7, e8, ROOK, QUEEN, MoveFlag::Check);
+  EXPECT_FALSE(tt.Probe(0x1234, &hit));
+  tt.Store(0x1234, m, -12.3, 5, TranspositionTable::LowerBound);
+  EXPECT_TRUE(tt.Probe(0x1234, &hit));
+  EXPECT_EQ(m, hit.move);
+  EXPECT_FLOAT_EQ(-12.3, hit.score);
+  EXPECT_EQ(5, hit.depth);
+  EXPECT_EQ(TranspositionTable::LowerBound, hit.bound);
+  EXPECT_FALSE(tt.Probe(0x1234 + tt.table.size(), &hit));
+
+  // A shallower non-exact result doesn't displace a deeper one from the same search
+  tt.Store(0x1234, GetMove(KNIGHT, g1, f3, 0, 0, 0), 1, 2, TranspositionTable::UpperBound);
+  EXPECT_TRUE(tt.Probe(0x1234, &hit));
+  EXPECT_EQ(m, hit.move);
+
+  // Fill the bucket, then the shallowest entry is the one replaced
+  for (int i = 1; i < 4; i++) tt.Store(0x1234 + i * tt.table.size(), m, i, 10 + i, TranspositionTable::Exact);
+  tt.Store(0x1234 + 4 * tt.table.size(), m, 0, 1, TranspositionTable::Exact);
+  EXPECT_FALSE(tt.Probe(0x1234, &hit));
+  EXPECT_TRUE(tt.Probe(0x1234 + 4 * tt.table.size(), &hit));
+
+  // Entries from earlier searches age out ahead of shallower new ones
+  tt.NewSearch();
+  tt.Store(0x1234 + 5 * tt.table.size(), m, 0, 9, TranspositionTable::Exact);
+  tt.Store(0x1234 + 6 * tt.table.size(), m, 0, 2, TranspositionTable::Exact);
+  EXPECT_FALSE(tt.Probe(0x1234 + tt.table.size(), &hit));
+  EXPECT_TRUE(tt.Probe(0x1234 + 2 * tt.table.size(), &hit));
+  EXPECT_TRUE(tt.Probe(0x1234 + 5 * tt.table.size(), &hit));
+  EXPECT_TRUE(tt.Probe(0x1234 + 6 * tt.table.size(), &hit));
+
+  // A torn entry fails verification
+  auto &e = tt.GetBucket(0x1234 + 5 * tt.table.size())->entry[0];
+  e.data.store(e.data.load() ^ 1);
+  EXPECT_FALSE(tt.Probe(0x1234 + 5 * tt.table.size(), &hit));
+
+  // Mate scores are kept relative to the stored node, and unbounded scores clamp
+  tt.Clear();
+  tt.Store(0x1234, m, MatedScore(5), 4, TranspositionTable::Exact, 3);
+  EXPECT_TRUE(tt.Probe(0x1234, &hit, 3));
+  EXPECT_EQ(MatedScore(5), hit.score);
+  EXPECT_TRUE(tt.Probe(0x1234, &hit, 1));
+  EXPECT_EQ(MatedScore(3), hit.score);
+  EXPECT_EQ(3, MateDistance(hit.score));
+  tt.Store(0x1234, m, -MatedScore(1), 4, TranspositionTable::Exact, 0);
+  EXPECT_TRUE(tt.Probe(0x1234, &hit, 2));
+  EXPECT_EQ(-MatedScore(3), hit.score);
+  tt.Store(0x1234, m, INFINITY, 5, TranspositionTable::LowerBound);
+  EXPECT_TRUE(tt.Probe(0x1234, &hit));
+  EXPECT_FLOAT_EQ(TranspositionTable::max_score, hit.score);
+
+  // A back rank mate is stored as a win for the side giving it
+  Position mate_position("6k1/5ppp/8/8/8/8/5PPP/R5K1 w - - 0 1");
+  SearchControl mate_control(&tt);
+  tt.Clear();
+  auto mate = AlphaBetaNegamaxSearch(mate_position, WHITE, -INFINITY, INFINITY, 2, &mate_control);
+  EXPECT_EQ("a1a8", GetLongMoveName(mate.first));
+  EXPECT_EQ(-MatedScore(1), mate.second);
+  EXPECT_TRUE(tt.Probe(mate_position.hash, &hit));
+  EXPECT_EQ(-MatedScore(1), hit.score);
+  EXPECT_EQ(TranspositionTable::Exact, hit.bound);
+
+  // Same answers as without the table, and the second search is answered from it
+  Position position;
+  SearchControl control(&tt);
+  tt.Clear();
+  EXPECT_EQ(true, position.LoadFEN("r1bq1r1k/1pppNppp/p7/4R2Q/n7/8/PPPP1PPP/R1B3K1 w - - 0 40"));
+  auto move = AlphaBetaNegamaxSearch(position, position.flags.to_move_color, -INFINITY, INFINITY, 3, &control);
+  EXPECT_GT(move.second, 100);
+  EXPECT_EQ("h5h7", GetLongMoveName(move.first));
+  EXPECT_TRUE(tt.Probe(position.hash, &hit));
+  EXPECT_EQ(TranspositionTable::Exact, hit.bound);
+  tt.NewSearch();
+  move = AlphaBetaNegamaxSearch(position, position.flags.to_move_color, -INFINITY, INFINITY, 3, &control);
+  EXPECT_EQ("h5h7", GetLongMoveName(move.first));
+
+  EXPECT_EQ(true, position.LoadFEN("r4r2/1q3pkp/p1b1p1n1/1p4QP/4P3/1BP3P1/P4P2/R2R2K1 w - - 0 40"));
+  move = AlphaBetaNegamaxSearch(position, position.flags.to_move_color, -INFINITY, INFINITY, 5, &control);
+  EXPECT_GT(move.second, 100);
+  EXPECT_EQ("h5h6", GetLongMoveName(move.first));
+}
+
+TEST(EvaluationTest, IterativeDeepening) {
+  SearchLimits limits = SearchLimits::FromUCI(" wtime 60000 btime 30000 winc 1000 binc 500 movestogo 20");
+  EXPECT_EQ(Time(60000), limits.time[WHITE]);
+  EXPECT_EQ(Time(500), limits.increment[BLACK]);
+  EXPECT_EQ(20, limits.moves_to_go);
+  EXPECT_EQ(SearchLimits::max_depth, limits.MaxDepth());
+  Time soft, hard;
+  EXPECT_TRUE(limits.Timed(BLACK));
+  limits.GetTimeLimits(BLACK, &soft, &hard);
+  EXPECT_LT(soft, hard);
+  EXPECT_LT(hard, Time(30000) / 3);
+  EXPECT_EQ(SearchLimits::default_depth, SearchLimits::FromUCI("").MaxDepth());
+  EXPECT_EQ(3, SearchLimits::FromUCI("depth 3").MaxDepth());
+  EXPECT_FALSE(SearchLimits::FromUCI("infinite").Timed(WHITE));
+
+  // Each iteration completes, and the last one's move is returned
+  Position position("r4r2/1q3pkp/p1b1p1n1/1p4QP/4P3/1BP3P1/P4P2/R2R2K1 w - - 0 40");
+  TranspositionTable tt(1);
+  SearchControl control(&tt);
+  vector<int> depths;
+  auto move = IterativeDeepeningSearch(position, SearchLimits::FromUCI("depth 5"), &control,
+                                       [&](int depth, const pair<Move, float>&) { depths.push_back(depth); });
+  EXPECT_EQ(vector<int>({ 1, 2, 3, 4, 5 }), depths);
+  EXPECT_EQ("h5h6", GetLongMoveName(move.first));
+
+  // A node budget stops the search, leaving the last completed iteration's move
+  SearchControl node_control(&tt);
+  tt.Clear();
+  depths.clear();
+  move = IterativeDeepeningSearch(Position(), SearchLimits::FromUCI("nodes 2000"), &node_control,
+                                  [&](int depth, const pair<Move, float>&) { depths.push_back(depth); });
+  EXPECT_TRUE(node_control.stopped);
+  EXPECT_LE(node_control.nodes, 2001);
+  EXPECT_LT(0, depths.size());
+  EXPECT_NE(0, move.first);
+
+  // As does the clock, soon after the hard limit
+  SearchControl time_control(&tt);
+  move = IterativeDeepeningSearch(Position(), SearchLimits::FromUCI("movetime 130"), &time_control);
+  EXPECT_NE(0, move.first);
+  EXPECT_LT(time_control.Elapsed(), Time(1000));
+}
+
+TEST(EvaluationTest, MoveOrdering) {
+  // The table move, then winning captures, then killers ahead of the other quiets, then losing captures
+  Position position("r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1");
+  MoveList moves;
+  GenerateMovesOfType<WHITE>(position, MoveGenType::All, ~0ULL, &moves);
+  auto find_move = [&](const string &name) { for (auto m : moves) if (GetLongMoveName(m) == name) return m; return Move(0); };
+  SearchHistory history;
+  history.killers[2][0] = find_move("a2a3");
+  MovePicker picker;
+  picker.Generate<WHITE>(position, MoveGenType::All, find_move("a1b1"), &history, 2);
+  vector<string> order;
+  for (Move m = picker.Next(); m; m = picker.Next()) order.push_back(GetLongMoveName(m));
+  EXPECT_EQ(moves.size(), order.size());
+  EXPECT_EQ("a1b1", order[0]);
+  EXPECT_EQ("e2a6", order[1]);
+  EXPECT_EQ("a2a3", order[4]);
+  EXPECT_EQ("f3f6", order[order.size() - 5]);
+  for (int i = 1; i < 4; i++) EXPECT_NE(0, GetMoveCapture(find_move(order[i])));
+  for (int i = 5, l = order.size() - 5; i < l; i++) EXPECT_EQ(0, GetMoveCapture(find_move(order[i])));
+
+  // Far more cutoffs come from the first move searched, at the same answers with fewer nodes
+  uint64_t cutoffs[2] = { 0, 0 }, first_move_cutoffs[2] = { 0, 0 }, nodes[2] = { 0, 0 };
+  for (auto &c : vector<pair<string, string>>{
+       { Position().GetFEN(), "" },
+       { "r1bq1r1k/1pppNppp/p7/4R2Q/n7/8/PPPP1PPP/R1B3K1 w - - 0 40", "h5h7" },
+       { "r4r2/1q3pkp/p1b1p1n1/1p4QP/4P3/1BP3P1/P4P2/R2R2K1 w - - 0 40", "h5h6" },
+       { "r7/2p2pk1/p5p1/1p1Q2Kp/1P6/2P1N2P/1P2n1P1/R5b1 b - - 0 40", "f7f6" } }) {
+    for (int ordered = 0; ordered < 2; ordered++) {
+      TranspositionTable tt(1);
+      SearchControl control(&tt);
+      control.move_ordering = ordered;
+      auto move = IterativeDeepeningSearch(Position(c.first), SearchLimits::FromUCI("depth 5"), &control);
+      if (c.second.size()) { EXPECT_EQ(c.second, GetLongMoveName(move.first)); }
+      cutoffs[ordered] += control.cutoffs;
+      first_move_cutoffs[ordered] += control.first_move_cutoffs;
+      nodes[ordered] += control.nodes;
+    }
+  }
+  float before = float(first_move_cutoffs[0]) / cutoffs[0], after = float(first_move_cutoffs[1]) / cutoffs[1];
+  INFO("MoveOrdering first move cutoffs before=", before, " after=", after, " nodes before=", nodes[0], " after=", nodes[1]);
+  EXPECT_LT(before, after);
+  EXPECT_LT(.9, after);
+  EXPECT_LT(nodes[1], nodes[0]);
+}
+
+TEST(Engine, GoPerft) {
+  string output;
+  Engine engine([&](const string &s) { output += s; });
+  engine.LineCB("position fen 8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 1");
+  engine.LineCB("go perft 3");
+  engine.WaitForSearch();
+  EXPECT_NE(string::npos, output.find("b4f4: 41\n"));
+  EXPECT_NE(string::npos, output.find("\nNodes searched: 2812\n"));
+}
+
+TEST(Engine, SetOptionHash) {
+  string output;
+  Engine engine([&](const string &s) { output += s; });
+  engine.LineCB("uci");
+  EXPECT_NE(string::npos, output.find("option name Hash type spin"));
+  engine.LineCB("setoption name Hash value 4");
+  EXPECT_EQ(size_t(4 << 20), engine.tt.table.size() * sizeof(TranspositionTable::Bucket));
+  engine.LineCB("position fen 4k3/4P3/3PK3/8/8/8/8/8 w - - 0 40");
+  engine.LineCB("go");
+  engine.WaitForSearch();
+  EXPECT_NE(string::npos, output.find("bestmove d6d7\n"));
+  engine.LineCB("go wtime 1000 btime 1000");
+  engine.WaitForSearch();
+  EXPECT_NE(string::npos, output.find("info depth 1 "));
+}
+
+int CountMatches(const string &text, const string &pattern) {
+  int count = 0;
+  for (size_t offset = text.find(pattern); offset != string::npos; offset = text.find(pattern, offset + 1)) count++;
+  return count;
+}
+
+TEST(Engine, Score) {
+  EXPECT_EQ("cp 150", GetUCIScore(1.5));
+  EXPECT_EQ("cp -3", GetUCIScore(-.03));
+  EXPECT_EQ("mate 1", GetUCIScore(-MatedScore(1)));
+  EXPECT_EQ("mate 2", GetUCIScore(-MatedScore(3)));
+  EXPECT_EQ("mate -1", GetUCIScore(MatedScore(2)));
+
+  // A mate in 1 reads as one at every depth, including depth 1's static mate
+  string output;
+  Engine engine([&](const string &s) { output += s; });
+  engine.LineCB("position fen 6k1/5ppp/8/8/8/8/5PPP/R5K1 w - - 0 1");
+  engine.LineCB("go depth 3");
+  engine.WaitForSearch();
+  EXPECT_EQ(3, CountMatches(output, " score mate 1 "));
+  EXPECT_NE(string::npos, output.find("bestmove a1a8\n"));
+}
+
+TEST(Engine, AsyncSearch) {
+  string output;
+  mutex output_lock;
+  Engine engine([&](const string &s) { lock_guard<mutex> lock(output_lock); output += s; });
+  auto get_output = [&]() { lock_guard<mutex> lock(output_lock); return output; };
+
+  // The input thread answers while an infinite search runs, and bestmove waits for stop
+  engine.LineCB("position startpos");
+  engine.LineCB("go infinite");
+  engine.LineCB("isready");
+  EXPECT_NE(string::npos, get_output().find("readyok\n"));
+  EXPECT_EQ(0, CountMatches(get_output(), "bestmove "));
+  engine.LineCB("stop");
+  EXPECT_EQ(1, CountMatches(get_output(), "bestmove "));
+
+  // stop without a search, or after one finished, writes nothing more
+  engine.LineCB("stop");
+  engine.LineCB("go depth 3");
+  engine.WaitForSearch();
+  engine.LineCB("stop");
+  EXPECT_EQ(2, CountMatches(get_output(), "bestmove "));
+
+  // A new go or quit ends the running search, which still answers once
+  engine.LineCB("go movetime 10000");
+  engine.LineCB("go depth 2");
+  engine.WaitForSearch();
+  EXPECT_EQ(4, CountMatches(get_output(), "bestmove "));
+
+  // perft runs on the search thread too, so a depth far too deep to finish still answers
+  // isready and stops, printing nothing
+  engine.LineCB("go perft 10");
+  engine.LineCB("isready");
+  EXPECT_EQ(2, CountMatches(get_output(), "readyok\n"));
+  engine.LineCB("stop");
+  EXPECT_EQ(string::npos, get_output().find("Nodes searched"));
+  engine.LineCB("go perft 10");
+  engine.LineCB("go infinite");
+  EXPECT_EQ(string::npos, get_output().find("Nodes searched"));
+  engine.LineCB("quit");
+  EXPECT_TRUE(engine.quit);
+  EXPECT_EQ(5, CountMatches(get_output(), "bestmove "));
+}
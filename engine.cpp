@@ -24,6 +24,7 @@ extern "C" int MyAppMain(LFApp*) {
   CHECK_EQ(0, LFL::app->Create(__FILE__));
   LFL::Chess::Engine engine([](const string &s) { write(1, s.data(), s.size()); });
   line_buf.cb = bind(&LFL::Chess::Engine::LineCB, &engine, _1);
-  while ((len = read(0, buf, sizeof(buf))) > 0) line_buf.AddData(StringPiece(buf, len));
+  while (!engine.quit && (len = read(0, buf, sizeof(buf))) > 0) line_buf.AddData(StringPiece(buf, len));
+  engine.WaitForSearch();
   return 0;
 }
@@ -18,10 +18,16 @@
 
 #ifndef LFL_CHESS_MAGIC_H__
 #define LFL_CHESS_MAGIC_H__
+#if !defined(CHESS_NO_AVX2) && defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define CHESS_AVX2_ATTACKS
+#endif
+#if defined(__BMI2__) || defined(CHESS_AVX2_ATTACKS)
+#include <immintrin.h>
+#endif
 namespace LFL {
 namespace Chess {
 
-static int rook_magic_number_bits[] = {
+static constexpr int rook_magic_number_bits[] = {
   12, 11, 11, 11, 11, 11, 11, 12,
   11, 10, 10, 10, 10, 10, 10, 11,
   11, 10, 10, 10, 10, 10, 10, 11,
@@ -32,7 +38,7 @@ static int rook_magic_number_bits[] = {
   12, 11, 11, 11, 11, 11, 11, 12
 };
 
-static int bishop_magic_number_bits[] = {
+static constexpr int bishop_magic_number_bits[] = {
   6, 5, 5, 5, 5, 5, 5, 6,
   5, 5, 5, 5, 5, 5, 5, 5,
   5, 5, 7, 7, 7, 7, 5, 5,
@@ -43,7 +49,7 @@ static int bishop_magic_number_bits[] = {
   6, 5, 5, 5, 5, 5, 5, 6
 };
 
-static BitBoard rook_magic_number[] = {
+static constexpr BitBoard rook_magic_number[] = {
   0xa180022080400230LL, 0x40100040022000LL,   0x80088020001002LL,   0x80080280841000LL,   0x4200042010460008LL, 0x4800a0003040080LL,  0x400110082041008LL, 0x8000a041000880LL,
   0x10138001a080c010LL, 0x804008200480LL,     0x10011012000c0LL,    0x22004128102200LL,   0x200081201200cLL,    0x202a001048460004LL, 0x81000100420004LL,  0x4000800380004500LL,
   0x208002904001LL,     0x90004040026008LL,   0x208808010002001LL,  0x2002020020704940LL, 0x8048010008110005LL, 0x6820808004002200LL, 0xa80040008023011LL, 0xb1460000811044LL,
@@ -54,7 +60,7 @@ static BitBoard rook_magic_number[] = {
   0x8080010a601241LL,   0x1008010400021LL,    0x4082001007241LL,    0x211009001200509LL,  0x8015001002441801LL, 0x801000804000603LL,  0xc0900220024a401LL, 0x1000200608243LL
 };
 
-static BitBoard bishop_magic_number[] = {
+static constexpr BitBoard bishop_magic_number[] = {
   0x2910054208004104LL, 0x2100630a7020180LL,  0x5822022042000000LL, 0x2ca804a100200020LL, 0x204042200000900LL,  0x2002121024000002LL, 0x80404104202000e8LL, 0x812a020205010840LL,
   0x8005181184080048LL, 0x1001c20208010101LL, 0x1001080204002100LL, 0x1810080489021800LL, 0x62040420010a00LL,   0x5028043004300020LL, 0xc0080a4402605002LL, 0x8a00a0104220200LL,
   0x940000410821212LL,  0x1808024a280210LL,   0x40c0422080a0598LL,  0x4228020082004050LL, 0x200800400e00100LL,  0x20b001230021040LL,  0x90a0201900c00LL,    0x4940120a0a0108LL,
@@ -65,7 +71,7 @@ static BitBoard bishop_magic_number[] = {
   0x2400202602104000LL, 0x208520209440204LL,  0x40c000022013020LL,  0x2000104000420600LL, 0x400000260142410LL,  0x800633408100500LL,  0x2404080a1410LL,     0x138200122002900LL    
 };
 
-static BitBoard rook_occupancy_mask[] = {
+static constexpr BitBoard rook_occupancy_mask[] = {
   0x101010101017eLL,    0x202020202027cLL,    0x404040404047aLL,    0x8080808080876LL,    0x1010101010106eLL,   0x2020202020205eLL,   0x4040404040403eLL,   0x8080808080807eLL,
   0x1010101017e00LL,    0x2020202027c00LL,    0x4040404047a00LL,    0x8080808087600LL,    0x10101010106e00LL,   0x20202020205e00LL,   0x40404040403e00LL,   0x80808080807e00LL,
   0x10101017e0100LL,    0x20202027c0200LL,    0x40404047a0400LL,    0x8080808760800LL,    0x101010106e1000LL,   0x202020205e2000LL,   0x404040403e4000LL,   0x808080807e8000LL,
@@ -76,7 +82,7 @@ static BitBoard rook_occupancy_mask[] = {
   0x7e01010101010100LL, 0x7c02020202020200LL, 0x7a04040404040400LL, 0x7608080808080800LL, 0x6e10101010101000LL, 0x5e20202020202000LL, 0x3e40404040404000LL, 0x7e80808080808000LL 
 };
 
-static BitBoard bishop_occupancy_mask[] = {
+static constexpr BitBoard bishop_occupancy_mask[] = {
   0x40201008040200LL, 0x402010080400LL,   0x4020100a00LL,     0x40221400LL,       0x2442800LL,        0x204085000LL,      0x20408102000LL,    0x2040810204000LL,
   0x20100804020000LL, 0x40201008040000LL, 0x4020100a0000LL,   0x4022140000LL,     0x244280000LL,      0x20408500000LL,    0x2040810200000LL,  0x4081020400000LL,
   0x10080402000200LL, 0x20100804000400LL, 0x4020100a000a00LL, 0x402214001400LL,   0x24428002800LL,    0x2040850005000LL,  0x4081020002000LL,  0x8102040004000LL,
@@ -87,7 +93,7 @@ static BitBoard bishop_occupancy_mask[] = {
   0x2040810204000LL,  0x4081020400000LL,  0xa102040000000LL,  0x14224000000000LL, 0x28440200000000LL, 0x50080402000000LL, 0x20100804020000LL, 0x40201008040200LL     
 };
 
-static BitBoard knight_occupancy_mask[] = {
+static constexpr BitBoard knight_occupancy_mask[] = {
   0x20400LL,           0x50800LL,           0xa1100LL,            0x142200LL,           0x284400LL,           0x508800LL,           0xa01000LL,           0x402000LL,
   0x2040004LL,         0x5080008LL,         0xa110011LL,          0x14220022LL,         0x28440044LL,         0x50880088LL,         0xa0100010LL,         0x40200020LL,
   0x204000402LL,       0x508000805LL,       0xa1100110aLL,        0x1422002214LL,       0x2844004428LL,       0x5088008850LL,       0xa0100010a0LL,       0x4020002040LL,
@@ -98,7 +104,7 @@ static BitBoard knight_occupancy_mask[] = {
   0x4020000000000LL,   0x8050000000000LL,   0x110a0000000000LL,   0x22140000000000LL,   0x44280000000000LL,   0x88500000000000LL,   0x10a00000000000LL,   0x20400000000000LL
 };
 
-static BitBoard king_occupancy_mask[] = {
+static constexpr BitBoard king_occupancy_mask[] = {
   0x302LL,             0x705LL,             0xe0aLL,             0x1c14LL,             0x3828LL,             0x7050LL,             0xe0a0LL,             0xc040LL,
   0x30203LL,           0x70507LL,           0xe0a0eLL,           0x1c141cLL,           0x382838LL,           0x705070LL,           0xe0a0e0LL,           0xc040c0LL,
   0x3020300LL,         0x7050700LL,         0xe0a0e00LL,         0x1c141c00LL,         0x38283800LL,         0x70507000LL,         0xe0a0e000LL,         0xc040c000LL,
@@ -109,7 +115,7 @@ static BitBoard king_occupancy_mask[] = {
   0x203000000000000LL, 0x507000000000000LL, 0xa0e000000000000LL, 0x141c000000000000LL, 0x2838000000000000LL, 0x5070000000000000LL, 0xa0e0000000000000LL, 0x40c0000000000000LL,
 };
 
-static BitBoard white_pawn_occupancy_mask[] = {
+static constexpr BitBoard white_pawn_occupancy_mask[] = {
   0x100LL,             0x200LL,             0x400LL,             0x800LL,             0x1000LL,             0x2000LL,             0x4000LL,             0x8000LL,
   0x1010000LL,         0x2020000LL,         0x4040000LL,         0x8080000LL,         0x10100000LL,         0x20200000LL,         0x40400000LL,         0x80800000LL,
   0x1000000LL,         0x2000000LL,         0x4000000LL,         0x8000000LL,         0x10000000LL,         0x20000000LL,         0x40000000LL,         0x80000000LL,
@@ -120,7 +126,7 @@ static BitBoard white_pawn_occupancy_mask[] = {
   0x0LL,               0x0LL,               0x0LL,               0x0LL,               0x0LL,                0x0LL,                0x0LL,                0x0LL,
 };
 
-static BitBoard white_pawn_attack_mask[] = {
+static constexpr BitBoard white_pawn_attack_mask[] = {
   0x200LL,             0x500LL,             0xa00LL,             0x1400LL,             0x2800LL,             0x5000LL,             0xa000LL,             0x4000LL,
   0x20000LL,           0x50000LL,           0xa0000LL,           0x140000LL,           0x280000LL,           0x500000LL,           0xa00000LL,           0x400000LL,
   0x2000000LL,         0x5000000LL,         0xa000000LL,         0x14000000LL,         0x28000000LL,         0x50000000LL,         0xa0000000LL,         0x40000000LL,
@@ -131,7 +137,7 @@ static BitBoard white_pawn_attack_mask[] = {
   0x0LL,               0x0LL,               0x0LL,               0x0LL,                0x0LL,                0x0LL,                0x0LL,                0x0LL 
 };
 
-static BitBoard black_pawn_occupancy_mask[] = {
+static constexpr BitBoard black_pawn_occupancy_mask[] = {
   0x0LL,             0x0LL,             0x0LL,             0x0LL,             0x0LL,              0x0LL,              0x0LL,              0x0LL,
   0x1LL,             0x2LL,             0x4LL,             0x8LL,             0x10LL,             0x20LL,             0x40LL,             0x80LL,
   0x100LL,           0x200LL,           0x400LL,           0x800LL,           0x1000LL,           0x2000LL,           0x4000LL,           0x8000LL,
@@ -142,7 +148,7 @@ static BitBoard black_pawn_occupancy_mask[] = {
   0x1000000000000LL, 0x2000000000000LL, 0x4000000000000LL, 0x8000000000000LL, 0x10000000000000LL, 0x20000000000000LL, 0x40000000000000LL, 0x80000000000000LL
 };
 
-static BitBoard black_pawn_attack_mask[] = {
+static constexpr BitBoard black_pawn_attack_mask[] = {
   0x0LL,             0x0LL,             0x0LL,             0x0LL,              0x0LL,              0x0LL,              0x0LL,              0x0LL,
   0x2LL,             0x5LL,             0xaLL,             0x14LL,             0x28LL,             0x50LL,             0xa0LL,             0x40LL,
   0x200LL,           0x500LL,           0xa00LL,           0x1400LL,           0x2800LL,           0x5000LL,           0xa000LL,           0x4000LL,
@@ -153,33 +159,53 @@ static BitBoard black_pawn_attack_mask[] = {
   0x2000000000000LL, 0x5000000000000LL, 0xa000000000000LL, 0x14000000000000LL, 0x28000000000000LL, 0x50000000000000LL, 0xa0000000000000LL, 0x40000000000000LL
 };
 
+struct MagicSquare {
+  BitBoard mask, magic;
+  uint32_t offset;
+  int shift;
+  constexpr int Index(BitBoard occupied) const { return int(((occupied & mask) * magic) >> shift); }
+};
+
+constexpr int MagicTableSize(const int *magic_number_bits) {
+  int size = 0;
+  for (int i=0; i<64; i++) size += 1 << magic_number_bits[i];
+  return size;
+}
+
+// All rook then bishop attack sets, indexed by MagicSquare::offset + MagicSquare::Index().
+// Built by the compiler; subsets of each mask are enumerated with the carry-rippler trick.
 struct MagicMoves {
-  vector<BitBoard> rook_magic_moves[64], bishop_magic_moves[64];
-  MagicMoves() {
+  static constexpr int RookTableSize = MagicTableSize(rook_magic_number_bits);
+  static constexpr int BishopTableSize = MagicTableSize(bishop_magic_number_bits);
+  alignas(64) BitBoard attacks[RookTableSize + BishopTableSize] = {};
+  MagicSquare rook[64] = {}, bishop[64] = {};
+
+  constexpr MagicMoves() {
+    uint32_t offset = 0;
     for (int i=0; i<64; i++) {
-      vector<BitBoard> occupancy_variation;
-      GetRookOccupancyVariations(i, &occupancy_variation);
-      SetupRookMagicMoves(i, occupancy_variation, &rook_magic_moves[i]);
+      rook[i] = { rook_occupancy_mask[i], rook_magic_number[i], offset, 64 - rook_magic_number_bits[i] };
+      BitBoard o = 0;
+      do { attacks[offset + rook[i].Index(o)] = RookAttacksSlow(i, o); o = (o - rook[i].mask) & rook[i].mask; } while (o);
+      offset += 1 << rook_magic_number_bits[i];
     }
     for (int i=0; i<64; i++) {
-      vector<BitBoard> occupancy_variation;
-      GetBishopOccupancyVariations(i, &occupancy_variation);
-      SetupBishopMagicMoves(i, occupancy_variation, &bishop_magic_moves[i]);
+      bishop[i] = { bishop_occupancy_mask[i], bishop_magic_number[i], offset, 64 - bishop_magic_number_bits[i] };
+      BitBoard o = 0;
+      do { attacks[offset + bishop[i].Index(o)] = BishopAttacksSlow(i, o); o = (o - bishop[i].mask) & bishop[i].mask; } while (o);
+      offset += 1 << bishop_magic_number_bits[i];
     }
   }
 
-  BitBoard RookMoves(int p, BitBoard blockers, BitBoard friendly) {
-    CHECK_RANGE(p, 0, 64);
-    int magic_index = MagicHash(p, blockers, rook_magic_number, rook_magic_number_bits);
-    CHECK_RANGE(magic_index, 0, rook_magic_moves[p].size());
-    return rook_magic_moves[p][magic_index] & ~friendly;
+  BitBoard RookAttacks(int p, BitBoard occupied) const {
+    DEBUG_CHECK_RANGE(p, 0, 64);
+    const MagicSquare &m = rook[p];
+    return attacks[m.offset + m.Index(occupied)];
   }
 
-  BitBoard BishopMoves(int p, BitBoard blockers, BitBoard friendly) {
-    CHECK_RANGE(p, 0, 64);
-    int magic_index = MagicHash(p, blockers, bishop_magic_number, bishop_magic_number_bits);
-    CHECK_RANGE(magic_index, 0, bishop_magic_moves[p].size());
-    return bishop_magic_moves[p][magic_index] & ~friendly;
+  BitBoard BishopAttacks(int p, BitBoard occupied) const {
+    DEBUG_CHECK_RANGE(p, 0, 64);
+    const MagicSquare &m = bishop[p];
+    return attacks[m.offset + m.Index(occupied)];
   }
 
   static int MagicHash(BitBoard occupancy, BitBoard magic_number, int magic_number_bits) {
@@ -230,39 +256,170 @@ struct MagicMoves {
     }
   }
 
-  static void SetupRookMagicMoves(int p, const vector<BitBoard> &occupancy_variation, vector<BitBoard> *magic_moves) {
-    magic_moves->resize(1 << rook_magic_number_bits[p]);
-    for (int i=0, j; i<occupancy_variation.size(); i++) {
-      int magic_index = MagicHash(p, occupancy_variation[i], rook_magic_number, rook_magic_number_bits);
-      BitBoard valid_moves = 0;
+  static constexpr BitBoard RookAttacksSlow(int p, BitBoard occupied) {
+    BitBoard valid_moves = 0;
+    int j = 0;
+    for (j=p+8; j<=63;         j+=8) { valid_moves |= (1ULL<<j); if ((occupied & (1ULL<<j)) != 0) break; }
+    for (j=p-8; j>= 0;         j-=8) { valid_moves |= (1ULL<<j); if ((occupied & (1ULL<<j)) != 0) break; }
+    for (j=p+1; j%8!=0;         j++) { valid_moves |= (1ULL<<j); if ((occupied & (1ULL<<j)) != 0) break; }
+    for (j=p-1; j%8!=7 && j>=0; j--) { valid_moves |= (1ULL<<j); if ((occupied & (1ULL<<j)) != 0) break; }
+    return valid_moves;
+  }
+
+  static constexpr BitBoard BishopAttacksSlow(int p, BitBoard occupied) {
+    BitBoard valid_moves = 0;
+    int j = 0;
+    for (j=p+9; j%8!=0 && j<=63; j+=9) { valid_moves |= (1ULL<<j); if ((occupied & (1ULL<<j)) != 0) break; }
+    for (j=p-9; j%8!=7 && j>= 0; j-=9) { valid_moves |= (1ULL<<j); if ((occupied & (1ULL<<j)) != 0) break; }
+    for (j=p+7; j%8!=7 && j<=63; j+=7) { valid_moves |= (1ULL<<j); if ((occupied & (1ULL<<j)) != 0) break; }
+    for (j=p-7; j%8!=0 && j>= 0; j-=7) { valid_moves |= (1ULL<<j); if ((occupied & (1ULL<<j)) != 0) break; }
+    return valid_moves;
+  }
+};
+
+#ifdef __BMI2__
+// Same table layout as MagicMoves, but indexed by _pext_u64(occupied, mask).  The carry-rippler
+// enumerates subsets of the mask in _pdep_u64() order, so subset i is stored at offset + i.
+struct PextMoves {
+  alignas(64) BitBoard attacks[MagicMoves::RookTableSize + MagicMoves::BishopTableSize] = {};
+  MagicSquare rook[64] = {}, bishop[64] = {};
+
+  constexpr PextMoves() {
+    uint32_t offset = 0;
+    for (int i=0; i<64; i++) {
+      rook[i] = { rook_occupancy_mask[i], 0, offset, 0 };
+      BitBoard o = 0;
+      do { attacks[offset++] = MagicMoves::RookAttacksSlow(i, o); o = (o - rook[i].mask) & rook[i].mask; } while (o);
+    }
+    for (int i=0; i<64; i++) {
+      bishop[i] = { bishop_occupancy_mask[i], 0, offset, 0 };
+      BitBoard o = 0;
+      do { attacks[offset++] = MagicMoves::BishopAttacksSlow(i, o); o = (o - bishop[i].mask) & bishop[i].mask; } while (o);
+    }
+  }
 
-      for (j=p+8; j<=63;         j+=8) { valid_moves |= (1LL<<j); if ((occupancy_variation[i] & (1LL<<j)) != 0) break; }
-      for (j=p-8; j>= 0;         j-=8) { valid_moves |= (1LL<<j); if ((occupancy_variation[i] & (1LL<<j)) != 0) break; }
-      for (j=p+1; j%8!=0;         j++) { valid_moves |= (1LL<<j); if ((occupancy_variation[i] & (1LL<<j)) != 0) break; }
-      for (j=p-1; j%8!=7 && j>=0; j--) { valid_moves |= (1LL<<j); if ((occupancy_variation[i] & (1LL<<j)) != 0) break; }
+  BitBoard RookAttacks(int p, BitBoard occupied) const {
+    DEBUG_CHECK_RANGE(p, 0, 64);
+    return attacks[rook[p].offset + _pext_u64(occupied, rook[p].mask)];
+  }
 
-      CHECK_RANGE(magic_index, 0, magic_moves->size());
-      (*magic_moves)[magic_index] = valid_moves;
+  BitBoard BishopAttacks(int p, BitBoard occupied) const {
+    DEBUG_CHECK_RANGE(p, 0, 64);
+    return attacks[bishop[p].offset + _pext_u64(occupied, bishop[p].mask)];
+  }
+};
+#endif
+
+// Hyperbola quintessence for files and diagonals plus an 8x64 first-rank table, about 2KB in total.
+struct HyperbolaMoves {
+  BitBoard file_mask[64] = {}, diagonal_mask[64] = {}, antidiagonal_mask[64] = {};
+  uint8_t rank_attacks[8][64] = {};
+
+  constexpr HyperbolaMoves() {
+    for (int p=0; p<64; p++) {
+      file_mask[p]         = LineMaskSlow(p, 0, 1);
+      diagonal_mask[p]     = LineMaskSlow(p, 1, 1);
+      antidiagonal_mask[p] = LineMaskSlow(p, -1, 1);
     }
+    for (int x=0; x<8; x++)
+      for (int inner=0; inner<64; inner++) {
+        int attacks = 0, occupied = inner << 1;
+        for (int i=x+1; i<8;  i++) { attacks |= (1<<i); if (occupied & (1<<i)) break; }
+        for (int i=x-1; i>=0; i--) { attacks |= (1<<i); if (occupied & (1<<i)) break; }
+        rank_attacks[x][inner] = attacks;
+      }
+  }
+
+  BitBoard RookAttacks(int p, BitBoard occupied) const {
+    DEBUG_CHECK_RANGE(p, 0, 64);
+    int rank_shift = p & ~7;
+    return LineAttacks(p, occupied, file_mask[p]) |
+      (BitBoard(rank_attacks[p & 7][(occupied >> (rank_shift + 1)) & 63]) << rank_shift);
+  }
+
+  BitBoard BishopAttacks(int p, BitBoard occupied) const {
+    DEBUG_CHECK_RANGE(p, 0, 64);
+    return LineAttacks(p, occupied, diagonal_mask[p]) | LineAttacks(p, occupied, antidiagonal_mask[p]);
+  }
+
+  static BitBoard LineAttacks(int p, BitBoard occupied, BitBoard mask) {
+    BitBoard square = 1ULL << p, forward = occupied & mask, reverse = ByteSwap(forward);
+    forward -= square;
+    reverse -= ByteSwap(square);
+    return (forward ^ ByteSwap(reverse)) & mask;
   }
 
-  static void SetupBishopMagicMoves(int p, const vector<BitBoard> &occupancy_variation, vector<BitBoard> *magic_moves) {
-    magic_moves->resize(1 << bishop_magic_number_bits[p]);
-    for (int i=0, j; i<occupancy_variation.size(); i++) {
-      int magic_index = MagicHash(p, occupancy_variation[i], bishop_magic_number, bishop_magic_number_bits);
-      BitBoard valid_moves = 0;
+  static constexpr BitBoard LineMaskSlow(int p, int dx, int dy) {
+    BitBoard mask = 0;
+    for (int d=-1; d<=1; d+=2)
+      for (int x=p%8+d*dx, y=p/8+d*dy; x>=0 && x<8 && y>=0 && y<8; x+=d*dx, y+=d*dy) mask |= (1ULL << (y*8 + x));
+    return mask;
+  }
+
+  static BitBoard ByteSwap(BitBoard x) {
+#ifdef _MSC_VER
+    return _byteswap_uint64(x);
+#else
+    return __builtin_bswap64(x);
+#endif
+  }
+};
 
-      for (j=p+9; j%8!=0 && j<=63; j+=9) { valid_moves |= (1LL<<j); if ((occupancy_variation[i] & (1LL<<j)) != 0) break; }
-      for (j=p-9; j%8!=7 && j>= 0; j-=9) { valid_moves |= (1LL<<j); if ((occupancy_variation[i] & (1LL<<j)) != 0) break; }
-      for (j=p+7; j%8!=7 && j<=63; j+=7) { valid_moves |= (1LL<<j); if ((occupancy_variation[i] & (1LL<<j)) != 0) break; }
-      for (j=p-7; j%8!=0 && j>= 0; j-=7) { valid_moves |= (1LL<<j); if ((occupancy_variation[i] & (1LL<<j)) != 0) break; }
+#ifdef CHESS_AVX2_ATTACKS
+// Kogge-Stone occluded fills for every slider of one color at once.  Each 64-bit lane of a
+// __m256i carries one direction, so one vector fills the four directions that shift left and a
+// second fills the four that shift right.  Built for AVX2 regardless of the -m flags and only
+// called when the CPU reports AVX2, see cpu_has_avx2.
+struct KoggeStoneAttacks {
+  __attribute__((target("avx2"))) static BitBoard SliderAttacks(BitBoard rooks, BitBoard bishops, BitBoard occupied) {
+    const BitBoard not_h = ~0x0101010101010101ULL, not_a = ~0x8080808080808080ULL;
+    //                                 toward a-file, up,  up+a,  up+h
+    const __m256i left_shift  = _mm256_setr_epi64x(1,      8,   9,     7);
+    const __m256i left_wrap   = _mm256_setr_epi64x(not_h, ~0LL, not_h, not_a);
+    //                                 toward h-file, down, down+h, down+a
+    const __m256i right_wrap  = _mm256_setr_epi64x(not_a, ~0LL, not_a, not_h);
+    const __m256i sliders = _mm256_setr_epi64x(rooks, rooks, bishops, bishops);
+    const __m256i empty = _mm256_set1_epi64x(~occupied);
+    __m256i left  = Fill<true> (sliders, _mm256_and_si256(empty, left_wrap),  left_shift);
+    __m256i right = Fill<false>(sliders, _mm256_and_si256(empty, right_wrap), left_shift);
+    left  = _mm256_and_si256(_mm256_sllv_epi64(left,  left_shift), left_wrap);
+    right = _mm256_and_si256(_mm256_srlv_epi64(right, left_shift), right_wrap);
+    __m256i both = _mm256_or_si256(left, right);
+    __m128i half = _mm_or_si128(_mm256_castsi256_si128(both), _mm256_extracti128_si256(both, 1));
+    return _mm_cvtsi128_si64(half) | _mm_extract_epi64(half, 1);
+  }
 
-      CHECK_RANGE(magic_index, 0, magic_moves->size());
-      (*magic_moves)[magic_index] = valid_moves;
+  template <bool Left> __attribute__((target("avx2"))) static __m256i Fill(__m256i gen, __m256i pro, __m256i shift) {
+    for (int i = 0; i < 3; i++) {
+      gen = _mm256_or_si256(gen, _mm256_and_si256(pro, Shift<Left>(gen, shift)));
+      pro = _mm256_and_si256(pro, Shift<Left>(pro, shift));
+      shift = _mm256_add_epi64(shift, shift);
     }
+    return gen;
+  }
+
+  template <bool Left> __attribute__((target("avx2"))) static __m256i Shift(__m256i x, __m256i shift) {
+    return Left ? _mm256_sllv_epi64(x, shift) : _mm256_srlv_epi64(x, shift);
   }
 };
 
+inline bool CPUHasAVX2() { return __builtin_cpu_supports("avx2"); }
+static const bool cpu_has_avx2 = CPUHasAVX2();
+#endif
+
+#if defined(CHESS_SLIDERS_PEXT)
+#ifndef __BMI2__
+#error CHESS_SLIDERS_PEXT requires BMI2
+#endif
+typedef PextMoves SliderMoves;
+#elif defined(CHESS_SLIDERS_HYPERBOLA)
+typedef HyperbolaMoves SliderMoves;
+#else
+typedef MagicMoves SliderMoves;
+#endif
+
+static constexpr SliderMoves slider_moves;
+
 }; // namespace Chess
 }; // namespace LFL
 #endif // LFL_CHESS_MAGIC_H__
@@ -1,41 +1,136 @@
 #include "core/app/app.h"
 #include "core/app/ipc.h"
+
+namespace LFL {
+Application *app;
+DEFINE_int(threads, 0, "Search threads, 0 for one per core");
+DEFINE_int(reduce_bits, 0, "Search for magics indexing this many fewer bits than the occupancy mask");
+DEFINE_int(max_attempts, 100000000, "Candidates to try per square before keeping the magic.h number");
+DEFINE_int(sparsity, 3, "Random words ANDed together per candidate");
+DEFINE_bool(rook, true, "Search rook magics");
+DEFINE_bool(bishop, true, "Search bishop magics");
+};
+
 #include "chess.h"
 
 namespace LFL {
 namespace Chess {
-void GenerateMagicNumbers(int p, const BitBoard *occupancyMask, const vector<BitBoard> &occupancy_variation,
-                          const vector<BitBoard> &attack_set, BitBoard *magic_number_out, int *magic_number_bits_out) {
-  int bit_count=Bit::Count(occupancyMask[p]), variation_count=int(1LL << bit_count);
-  vector<BitBoard> used_by(int(1LL << bit_count), 0);
-  BitBoard magic_number;
-
-  bool fail=0;
-  for (int attempts=0; /**/; ++attempts, fail=0) {
-    magic_number = Rand64() & Rand64() & Rand64();
-
-    for (int i=0;          i<variation_count; i++) used_by[i] = 0;
-    for (int i=0; !fail && i<variation_count; i++) {
-      int magic_index = MagicMoves::MagicHash(occupancy_variation[i], magic_number, bit_count);
-      fail = used_by[magic_index] != 0 && used_by[magic_index] != attack_set[i];
-      used_by[magic_index] = attack_set[i];
+struct MagicSearch {
+  int p, bit_count;
+  atomic<bool> found{false};
+  BitBoard magic_number=0;
+  vector<BitBoard> occupancy_variation, attack_set;
+};
+
+// Distinct occupancies may share a slot when they yield the same attack set (a constructive
+// collision), which is what lets a magic index fewer bits than the occupancy mask has.
+bool TryMagicNumber(const MagicSearch &search, BitBoard magic_number, vector<BitBoard> *used_by,
+                    vector<uint32_t> *used_epoch, uint32_t epoch) {
+  for (int i=0, l=search.occupancy_variation.size(); i<l; i++) {
+    int magic_index = MagicMoves::MagicHash(search.occupancy_variation[i], magic_number, search.bit_count);
+    if ((*used_epoch)[magic_index] != epoch) {
+      (*used_epoch)[magic_index] = epoch;
+      (*used_by)[magic_index] = search.attack_set[i];
+    } else if ((*used_by)[magic_index] != search.attack_set[i]) return false;
+  }
+  return true;
+}
+
+void GenerateMagicNumbers(MagicSearch *search, mt19937_64 *rand_engine) {
+  vector<BitBoard> used_by(1 << search->bit_count);
+  vector<uint32_t> used_epoch(1 << search->bit_count, 0);
+  for (int attempts=1; attempts <= FLAGS_max_attempts && !search->found; ++attempts) {
+    BitBoard magic_number = (*rand_engine)();
+    for (int i=1; i<FLAGS_sparsity; i++) magic_number &= (*rand_engine)();
+    if (!TryMagicNumber(*search, magic_number, &used_by, &used_epoch, attempts)) continue;
+    bool expected = false;
+    if (search->found.compare_exchange_strong(expected, true)) search->magic_number = magic_number;
+  }
+}
+
+// Threads first take squares in order, then pile onto squares still being searched.
+void RunMagicSearches(vector<unique_ptr<MagicSearch>> *searches, int threads) {
+  atomic<int> next_search(0);
+  vector<thread> workers;
+  for (int t=0; t<threads; t++) workers.emplace_back([&, t]() {
+    random_device seed;
+    mt19937_64 rand_engine(seed() ^ t);
+    for (int n = next_search++, l = searches->size(); ; n = next_search++) {
+      MagicSearch *search = n < l ? (*searches)[n].get() : nullptr;
+      for (int i=0; !search && i<l; i++) {
+        MagicSearch *s = (*searches)[(n + i) % l].get();
+        if (!s->found) search = s;
+      }
+      if (!search) break;
+      GenerateMagicNumbers(search, &rand_engine);
+      if (n >= l && !search->found) break;
     }
-  } 
-  while (fail);
+  });
+  for (auto &w : workers) w.join();
+}
+
+string MagicArrays(const char *name, const vector<unique_ptr<MagicSearch>> &searches,
+                   const BitBoard *default_magic, const int *default_bits) {
+  string bits = StrCat("static constexpr int ", name, "_magic_number_bits[] = {\n");
+  string magic = StrCat("static constexpr BitBoard ", name, "_magic_number[] = {\n");
+  for (int p=0; p<64; p++) {
+    const MagicSearch *s = searches[p].get();
+    StrAppend(&bits, (p % 8) ? " " : "  ", s->found ? s->bit_count : default_bits[p], p == 63 ? "\n" : ",");
+    StrAppend(&magic, (p % 8) ? " " : "  ", StringPrintf("0x%llxLL", s->found ? s->magic_number : default_magic[p]),
+              p == 63 ? "\n" : ",");
+    if (p % 8 == 7 && p != 63) { bits += "\n"; magic += "\n"; }
+  }
+  return StrCat(bits, "};\n\n", magic, "};\n");
+}
+
+int MagicTableSize(const vector<unique_ptr<MagicSearch>> &searches, const int *default_bits) {
+  int size = 0;
+  for (int p=0; p<64; p++) size += 1 << (searches[p]->found ? searches[p]->bit_count : default_bits[p]);
+  return size;
+}
 
-  *magic_number_out = magic_number;
-  *magic_number_bits_out = bit_count;
+vector<unique_ptr<MagicSearch>> MakeMagicSearches(bool rook) {
+  vector<unique_ptr<MagicSearch>> ret;
+  for (int p=0; p<64; p++) {
+    ret.emplace_back(make_unique<MagicSearch>());
+    MagicSearch *s = ret.back().get();
+    s->p = p;
+    s->bit_count = Bit::Count(rook ? rook_occupancy_mask[p] : bishop_occupancy_mask[p]) - FLAGS_reduce_bits;
+    if (rook) MagicMoves::GetRookOccupancyVariations  (p, &s->occupancy_variation);
+    else      MagicMoves::GetBishopOccupancyVariations(p, &s->occupancy_variation);
+    for (auto o : s->occupancy_variation)
+      s->attack_set.push_back(rook ? MagicMoves::RookAttacksSlow(p, o) : MagicMoves::BishopAttacksSlow(p, o));
+  }
+  return ret;
 }
 
 }; // namespace Chess
 }; // namespace LFL
 using namespace LFL;
+using namespace LFL::Chess;
 
-extern "C" void MyAppCreate(int argc, const char* const* argv) {
-  app = new Application(argc, argv);
-  app->focused = new Window();
+extern "C" LFApp *MyAppCreate(int argc, const char* const* argv) {
+  app = make_unique<Application>(argc, argv).release();
+  app->focused = app->framework->ConstructWindow(app).release();
+  return app;
 }
 
-extern "C" int MyAppMain() {
+extern "C" int MyAppMain(LFApp*) {
+  if (app->Create(__FILE__)) return -1;
+  int threads = FLAGS_threads ? FLAGS_threads : max(1u, thread::hardware_concurrency());
+  for (int rook=1; rook>=0; rook--) {
+    if (!(rook ? FLAGS_rook : FLAGS_bishop)) continue;
+    auto searches = MakeMagicSearches(rook);
+    Time start = Now();
+    RunMagicSearches(&searches, threads);
+    const BitBoard *default_magic = rook ? rook_magic_number : bishop_magic_number;
+    const int *default_bits = rook ? rook_magic_number_bits : bishop_magic_number_bits;
+    int found = 0;
+    for (auto &s : searches) found += s->found;
+    printf("// %s: %d/64 squares at reduce_bits=%d in %lld ms, table %d -> %d entries\n%s\n",
+           rook ? "rook" : "bishop", found, FLAGS_reduce_bits, (long long)(Now() - start).count(),
+           MagicTableSize(default_bits), MagicTableSize(searches, default_bits),
+           MagicArrays(rook ? "rook" : "bishop", searches, default_magic, default_bits).c_str());
+  }
   return 0;
 }
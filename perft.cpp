@@ -0,0 +1,207 @@
+#include "core/app/app.h"
+#include "core/app/ipc.h"
+
+namespace LFL {
+Application *app;
+DEFINE_string(fen, "", "Position to search, the initial position if neither -fen nor -epd is given");
+DEFINE_string(epd, "", "perftsuite.epd style file of positions and expected node counts");
+DEFINE_int(depth, 0, "Search depth, 0 for the deepest count listed in -epd or 5 otherwise");
+DEFINE_int(threads, 0, "Search threads, 0 for one per core");
+DEFINE_bool(divide, false, "Print the node count under each root move");
+DEFINE_bool(json, false, "Print one JSON object per position, then a summary object");
+DEFINE_bool(bench, false, "Time the move generation micro-benchmarks on -fen, or kiwipete, instead");
+};
+
+#include "chess.h"
+
+namespace LFL {
+namespace Chess {
+static const char *kiwipete_fen = "r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1";
+
+struct PerftJob {
+  string fen;
+  int depth=0;
+  int64_t expected=-1;
+};
+
+struct PerftResult {
+  uint64_t nodes=0;
+  Time elapsed=Time(0);
+  vector<pair<Move, uint64_t>> divide;
+  int64_t Nps() const { return nodes * 1000 / max(Time(1), elapsed).count(); }
+};
+
+bool LoadPerftJobs(const string &epd, int depth, vector<PerftJob> *out) {
+  LocalFile file(epd, "r");
+  if (!file.Opened()) return ERRORv(false, "open ", epd);
+  FileLineIter lines(&file);
+  vector<string> arg;
+  for (const char *line = lines.Next(); line; line = lines.Next()) {
+    Split(StringPiece(line, lines.CurrentLength()), isint<';'>, nullptr, &arg);
+    if (arg.size() < 2) continue;
+    PerftJob job;
+    job.fen = arg[0];
+    while (job.fen.size() && isspace(job.fen.back())) job.fen.pop_back();
+    job.depth = depth ? min(depth, int(arg.size()) - 1) : int(arg.size()) - 1;
+    if (!PrefixMatch(arg[job.depth], StrCat("D", job.depth, " "))) return ERRORv(false, "bad count ", arg[job.depth]);
+    if (depth <= job.depth) job.expected = strtoll(arg[job.depth].data() + 3, nullptr, 10);
+    else                    job.depth = depth;
+    out->push_back(move(job));
+  }
+  return true;
+}
+
+string PerftJSON(const PerftJob &job, const PerftResult &result) {
+  string ret = StrCat("{\"fen\":\"", job.fen, "\",\"depth\":", job.depth, ",\"nodes\":", result.nodes);
+  if (job.expected >= 0) StrAppend(&ret, ",\"expected\":", job.expected);
+  StrAppend(&ret, ",\"ms\":", result.elapsed.count(), ",\"nps\":", result.Nps());
+  if (result.divide.size()) {
+    ret += ",\"divide\":{";
+    for (auto &d : result.divide) StrAppend(&ret, &d == &result.divide[0] ? "" : ",", "\"", GetUCIMoveName(d.first), "\":", d.second);
+    ret += "}";
+  }
+  return StrCat(ret, "}\n");
+}
+
+// Each benchmark reports how many operations it timed, so per_sec compares across builds.
+void PrintBenchmark(const string &name, uint64_t count, Time elapsed) {
+  int64_t per_sec = count * 1000 / max(Time(1), elapsed).count();
+  if (FLAGS_json) printf("{\"bench\":\"%s\",\"count\":%llu,\"ms\":%lld,\"per_sec\":%lld}\n", name.c_str(),
+                         (unsigned long long)count, (long long)elapsed.count(), (long long)per_sec);
+  else printf("bench %s count=%llu time=%lldms per_sec=%lld\n", name.c_str(), (unsigned long long)count,
+              (long long)elapsed.count(), (long long)per_sec);
+}
+
+template <class F> void RunBenchmark(const string &name, F f) {
+  Time start = Now();
+  uint64_t count = f();
+  PrintBenchmark(name, count, Now() - start);
+}
+
+template <class X> void SliderBenchmark(const string &name, const X &sliders, const vector<BitBoard> &occupancy, BitBoard *sum) {
+  RunBenchmark(name, [&]() {
+    for (auto o : occupancy)
+      for (int p = 0; p < 64; p++) *sum += sliders.RookAttacks(p, o) ^ sliders.BishopAttacks(p, o);
+    return uint64_t(occupancy.size()) * 64 * 2;
+  });
+}
+
+// CopyMakePerft over a MoveList, so copy_make_perft against this isolates vector<Move> vs MoveList.
+uint64_t MoveListCopyMakePerft(const Position &in, bool color, int depth) {
+  if (depth <= 0) return 1;
+  MoveList moves;
+  GenerateMoves(in, color, &moves);
+  if (depth == 1) return moves.size();
+  uint64_t nodes = 0;
+  for (auto &m : moves) {
+    Position position = in;
+    position.ApplyValidatedMove(m);
+    nodes += MoveListCopyMakePerft(position, !color, depth-1);
+  }
+  return nodes;
+}
+
+int RunBenchmarks(const Position &position, int depth) {
+  bool color = position.flags.to_move_color;
+  RunBenchmark("copy_make_perft", [&]() { return CopyMakePerft(position, color, depth); });
+  RunBenchmark("movelist_copy_make_perft", [&]() { return MoveListCopyMakePerft(position, color, depth); });
+  RunBenchmark("make_unmake_perft", [&]() { return Perft(position, color, depth); });
+  RunBenchmark("cached_perft", [&]() {
+    PerftCache cache(20);
+    return Perft(position, color, depth + 1, &cache);
+  });
+  RunBenchmark("full_search_leaves", [&]() {
+    vector<SearchStats::Total> depth_total;
+    SearchStats search;
+    search.max_depth = depth;
+    search.depth_total = &depth_total;
+    FullSearch(position, color, &search);
+    return depth_total.size() ? depth_total.back().nodes : 0;
+  });
+
+  // The lookup loops feed one sum, so none is optimized away, and it nets out to the move counts
+  const int lookups = 100000;
+  uint64_t sum = 0;
+  RunBenchmark("scan_square_lookups", [&]() {
+    for (int i = 0; i < lookups; i++) for (int s = 0; s < 64; s++) sum += position.ScanSquare(s);
+    return uint64_t(lookups) * 64;
+  });
+  RunBenchmark("mailbox_lookups", [&]() {
+    for (int i = 0; i < lookups; i++) for (int s = 0; s < 64; s++) sum -= position.GetSquare(s);
+    return uint64_t(lookups) * 64;
+  });
+  RunBenchmark("generate_moves_calls", [&]() {
+    MoveList moves;
+    for (int i = 0; i < lookups; i++) { GenerateMoves(position, color, &moves); sum += moves.size(); }
+    return uint64_t(lookups);
+  });
+  if (sum != uint64_t(lookups) * GenerateMoves(position, color).size()) return ERRORv(-1, "mailbox and ScanSquare disagree");
+
+  vector<BitBoard> occupancy;
+  for (int i = 0; i < (1 << 18); i++) occupancy.push_back(Rand64() & Rand64());
+  BitBoard magic_sum = 0, hyperbola_sum = 0;
+  SliderBenchmark("magic_slider_lookups",     *make_unique<MagicMoves>(),     occupancy, &magic_sum);
+  SliderBenchmark("hyperbola_slider_lookups", *make_unique<HyperbolaMoves>(), occupancy, &hyperbola_sum);
+  if (magic_sum != hyperbola_sum) return ERRORv(-1, "hyperbola and magic slider attacks disagree");
+#ifdef __BMI2__
+  BitBoard pext_sum = 0;
+  SliderBenchmark("pext_slider_lookups", *make_unique<PextMoves>(), occupancy, &pext_sum);
+  if (magic_sum != pext_sum) return ERRORv(-1, "pext and magic slider attacks disagree");
+#endif
+  return 0;
+}
+
+}; // namespace Chess
+}; // namespace LFL
+using namespace LFL;
+using namespace LFL::Chess;
+
+extern "C" LFApp *MyAppCreate(int argc, const char* const* argv) {
+  app = make_unique<Application>(argc, argv).release();
+  app->focused = app->framework->ConstructWindow(app).release();
+  return app;
+}
+
+extern "C" int MyAppMain(LFApp*) {
+  if (app->Create(__FILE__)) return -1;
+  if (FLAGS_bench) {
+    Position position;
+    if (!position.LoadFEN(FLAGS_fen.size() ? FLAGS_fen : kiwipete_fen)) return ERRORv(-1, "load FEN '", FLAGS_fen, "'");
+    return RunBenchmarks(position, FLAGS_depth ? FLAGS_depth : 4);
+  }
+  vector<PerftJob> jobs;
+  if (FLAGS_epd.size()) { if (!LoadPerftJobs(FLAGS_epd, FLAGS_depth, &jobs)) return -1; }
+  else jobs.push_back(PerftJob{ FLAGS_fen.size() ? FLAGS_fen : Position().GetFEN(), FLAGS_depth ? FLAGS_depth : 5 });
+
+  int threads = FLAGS_threads ? FLAGS_threads : max(1u, thread::hardware_concurrency()), mismatches = 0;
+  uint64_t total_nodes = 0;
+  Time total_time(0);
+  for (int i = 0, l = jobs.size(); i != l; ++i) {
+    const PerftJob &job = jobs[i];
+    Position position;
+    if (!position.LoadFEN(job.fen)) { ERROR("load FEN '", job.fen, "'"); mismatches++; continue; }
+    PerftResult result;
+    Time start = Now();
+    result.nodes = ParallelPerft(position, position.flags.to_move_color, job.depth, threads,
+                                 FLAGS_divide ? &result.divide : nullptr);
+    result.elapsed = Now() - start;
+    bool mismatch = job.expected >= 0 && uint64_t(job.expected) != result.nodes;
+    mismatches += mismatch;
+    total_nodes += result.nodes;
+    total_time += result.elapsed;
+
+    if (FLAGS_json) { printf("%s", PerftJSON(job, result).c_str()); continue; }
+    for (auto &d : result.divide) printf("%s: %llu\n", GetUCIMoveName(d.first).c_str(), (unsigned long long)d.second);
+    printf("perft[%d] depth=%d nodes=%llu%s time=%lldms nps=%lld %s%s\n", i + 1, job.depth,
+           (unsigned long long)result.nodes, job.expected < 0 ? "" : StrCat(" expected=", job.expected).c_str(),
+           (long long)result.elapsed.count(), (long long)result.Nps(), job.fen.c_str(), mismatch ? " MISMATCH" : "");
+  }
+
+  int64_t nps = total_nodes * 1000 / max(Time(1), total_time).count();
+  if (FLAGS_json) printf("{\"positions\":%zu,\"threads\":%d,\"nodes\":%llu,\"ms\":%lld,\"nps\":%lld,\"mismatches\":%d}\n",
+                         jobs.size(), threads, (unsigned long long)total_nodes, (long long)total_time.count(),
+                         (long long)nps, mismatches);
+  else printf("positions=%zu threads=%d nodes=%llu time=%lldms nps=%lld mismatches=%d\n", jobs.size(), threads,
+              (unsigned long long)total_nodes, (long long)total_time.count(), (long long)nps, mismatches);
+  return mismatches ? 1 : 0;
+}